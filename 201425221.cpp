@@ -2,10 +2,34 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <sstream>
+#include <atomic>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#ifdef HEADLESS
+#include <chrono>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// Sample_GL.vert/.frag as string constants, generated by embed_shaders.sh (see Makefile)
+#include "Sample_GL_shaders.h"
+#include "game_logic.h"
+#include "input_log.h"
+
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
@@ -13,20 +37,41 @@
 
 using namespace std;
 
+/* Encodings of interleaved meshes on the GPU. Vertex data is always built as Vertex and
+   packed on upload, so compact formats only change what create3DObject stores */
+#define POSITION_FLOAT 0 // 3 x GL_FLOAT
+#define POSITION_HALF 1  // 4 x GL_HALF_FLOAT, the 4th is padding
+#define POSITION_PACKED 2// GL_INT_2_10_10_10_REV, whole steps of scale in -511..511
+struct VertexFormat {
+    int position;
+    bool byteColors;// color and edge as normalized GL_UNSIGNED_BYTE
+    GLfloat scale;  // POSITION_PACKED step, the Model matrix has to scale positions back up
+};
+static const VertexFormat FloatVertices = { POSITION_FLOAT, false, 1 };// same layout as Vertex
+
 struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLuint ColorBuffer;// same as VertexBuffer for interleaved meshes
+    GLuint IndexBuffer;// 0 for non-indexed meshes
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;
+    VertexFormat Format;// interleaved meshes only
 };
 typedef struct VAO VAO;
 
+/* Interleaved vertex used by indexed meshes */
+struct Vertex {
+    GLfloat position[3];
+    GLfloat color[3];
+    GLfloat edge[3];// position across the face (0..1, 0..1) and outline width, 0 for no outline
+};
+
 typedef struct block {
-    VAO * cube;
-    VAO * cube_border;
+    VAO * cube;//shared with every block of the same type, see get_block_mesh
     int type;//0for ground, 1 for water
     bool shm;
     int y;
@@ -42,86 +87,319 @@ struct GLMatrices {
     glm::mat4 projection;
     glm::mat4 model;
     glm::mat4 view;
-    GLuint MatrixID;
+    GLuint ModelID;
+    GLuint CameraBuffer;// uniform buffer holding CameraBlock
 } Matrices;
 
-GLuint programID;
+/* Per-frame camera data, std140 layout of the Camera block in Sample_GL.vert */
+struct CameraBlock {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::mat4 VP;
+    GLfloat time;
+    GLfloat pad[3];
+};
+#define CAMERA_BINDING 0
+bool camera_dirty = true;// projection or view changed, upload the whole block
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+GLuint programID;
 
-    // Create the shaders
-    GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-    GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* Program binary cache - a linked program is saved in the per-user cache directory and reloaded
+   with glProgramBinary on the next launch, as long as the shader sources and the driver
+   are unchanged. Anything else falls back to compiling from source */
+#define PROGRAM_CACHE_MAGIC 0x47505243// "CRPG"
+struct ProgramCacheHeader {
+    uint32_t magic;
+    uint64_t key;
+    GLenum format;
+    GLint length;
+};
 
-    // Read the Vertex Shader code from the file
-    std::string VertexShaderCode;
-    std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-    if(VertexShaderStream.is_open())
-    {
-        std::string Line = "";
-        while(getline(VertexShaderStream, Line))
-            VertexShaderCode += "\n" + Line;
-        VertexShaderStream.close();
+/* FNV-1a over the sources and the driver strings, a driver update invalidates the binary */
+uint64_t programCacheKey (const std::string& vertex_code, const std::string& fragment_code)
+{
+    std::string driver;
+    const char* strings[] = { (const char*) glGetString(GL_VENDOR), (const char*) glGetString(GL_RENDERER), (const char*) glGetString(GL_VERSION) };
+    for (int i = 0; i < 3; i++)
+        driver += std::string(strings[i] ? strings[i] : "") + "\n";
+    std::string all = vertex_code + '\0' + fragment_code + '\0' + driver;
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < all.size(); i++) {
+        hash ^= (unsigned char) all[i];
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
-    // Read the Fragment Shader code from the file
-    std::string FragmentShaderCode;
-    std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-    if(FragmentShaderStream.is_open()){
-        std::string Line = "";
-        while(getline(FragmentShaderStream, Line))
-            FragmentShaderCode += "\n" + Line;
-        FragmentShaderStream.close();
+/* $XDG_CACHE_HOME/2d-cannon-game/ or ~/.cache/2d-cannon-game/, created on first use.
+   Returns "" when there is no such place, which disables the cache */
+std::string programCacheDir ()
+{
+    std::string dir;
+#ifdef __linux__
+    const char* cache_home = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (cache_home && cache_home[0])
+        dir = cache_home;
+    else if (home && home[0])
+        dir = std::string(home) + "/.cache";
+    else
+        return "";
+    mkdir(dir.c_str(), 0700);// usually there already
+    dir += "/2d-cannon-game";
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s, shader binaries are not cached\n", dir.c_str());
+        return "";
     }
+    dir += "/";
+#endif
+    return dir;
+}
+
+bool programBinarySupported ()
+{
+    GLint formats = 0;
+    if (GLAD_GL_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+/* Returns the cached program for key, or 0 when there is none or the driver rejects it */
+GLuint loadProgramBinary (const char* cache_path, uint64_t key)
+{
+    std::ifstream cache(cache_path, std::ios::in | std::ios::binary);
+    ProgramCacheHeader header;
+    if (!cache.read((char*) &header, sizeof(header)) || header.magic != PROGRAM_CACHE_MAGIC || header.key != key || header.length <= 0)
+        return 0;
+    std::vector<char> binary(header.length);
+    if (!cache.read(&binary[0], header.length))
+        return 0;
 
+    GLuint ProgramID = glCreateProgram();
+    glProgramBinary(ProgramID, header.format, &binary[0], header.length);
     GLint Result = GL_FALSE;
-    int InfoLogLength;
+    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+    if (Result != GL_TRUE) {
+        glDeleteProgram(ProgramID);
+        return 0;
+    }
+    return ProgramID;
+}
+
+void saveProgramBinary (const char* cache_path, uint64_t key, GLuint ProgramID)
+{
+    ProgramCacheHeader header;
+    header.magic = PROGRAM_CACHE_MAGIC;
+    header.key = key;
+    glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &header.length);
+    if (header.length <= 0)
+        return;
+    std::vector<char> binary(header.length);
+    glGetProgramBinary(ProgramID, header.length, NULL, &header.format, &binary[0]);
+
+    std::ofstream cache(cache_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    cache.write((const char*) &header, sizeof(header));
+    cache.write(&binary[0], header.length);
+    cache.close();
+    if (!cache)
+        fprintf(stderr, "Cannot write the shader cache %s\n", cache_path);
+}
+
+/* Shader manager - programs are compiled and linked without asking GL for the result, so the
+   driver can work on all of them at once. With ARB_parallel_shader_compile completion is
+   polled once per frame and the scene renders with a simple fallback program meanwhile,
+   without it finishing a program waits for the driver */
+#define SHADER_PENDING 0
+#define SHADER_READY 1
+#define SHADER_FAILED 2
+struct ShaderProgram {
+    std::string name;// for messages
+    std::string vertex_file, fragment_file;// shader names when started by requestShaderProgram
+    GLuint VertexShaderID;
+    GLuint FragmentShaderID;
+    GLuint ProgramID;
+    bool use_cache;
+    uint64_t cache_key;
+    std::string cache_path;
+    int status;
+};
+vector<ShaderProgram*> shader_programs;
+
+bool readShaderFile (const std::string& file_path, std::string& ShaderCode)
+{
+    std::ifstream ShaderStream(file_path.c_str(), std::ios::in);
+    if (!ShaderStream.is_open())
+        return false;
+    std::ostringstream contents;
+    contents << ShaderStream.rdbuf();
+    ShaderCode = contents.str();
+    return true;
+}
+
+/* Source of a shader by file name - from $SHADER_DIR when it is set, so shaders can be edited
+   without rebuilding, otherwise the copy compiled into the binary */
+std::string loadShaderSource (const char * name)
+{
+    const char * shader_dir = getenv("SHADER_DIR");
+    std::string ShaderCode;
+    if (shader_dir) {
+        std::string file_path = std::string(shader_dir) + "/" + name;
+        if (readShaderFile(file_path, ShaderCode))
+            return ShaderCode;
+        fprintf(stderr, "Cannot read %s, using the built-in %s\n", file_path.c_str(), name);
+    }
+    for (size_t i = 0; i < sizeof(embedded_shaders)/sizeof(embedded_shaders[0]); i++)
+        if (strcmp(embedded_shaders[i].name, name) == 0)
+            return embedded_shaders[i].source;
+    fprintf(stderr, "Unknown shader %s\n", name);
+    return ShaderCode;
+}
+
+/* Starts compiling and linking a program, cache_path "" disables the binary cache */
+void startShaderProgram (ShaderProgram* program, const std::string& name, const std::string& VertexShaderCode, const std::string& FragmentShaderCode, const std::string& cache_path)
+{
+    program->name = name;
+    program->status = SHADER_PENDING;
+    program->VertexShaderID = program->FragmentShaderID = 0;
+    program->cache_path = cache_path;
+    program->use_cache = !cache_path.empty() && programBinarySupported();
+    program->cache_key = program->use_cache ? programCacheKey(VertexShaderCode, FragmentShaderCode) : 0;
+
+    // Skip compiling when an earlier run left a binary of this program
+    if (program->use_cache) {
+        program->ProgramID = loadProgramBinary(cache_path.c_str(), program->cache_key);
+        if (program->ProgramID) {
+            printf("Loaded program binary : %s\n", cache_path.c_str());
+            program->status = SHADER_READY;
+            return;
+        }
+    }
 
-    // Compile Vertex Shader
-    printf("Compiling shader : %s\n", vertex_file_path);
+    printf("Compiling program : %s\n", name.c_str());
+    program->VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+    program->FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
     char const * VertexSourcePointer = VertexShaderCode.c_str();
-    glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-    glCompileShader(VertexShaderID);
-
-    // Check Vertex Shader
-    glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-    fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-    // Compile Fragment Shader
-    printf("Compiling shader : %s\n", fragment_file_path);
+    glShaderSource(program->VertexShaderID, 1, &VertexSourcePointer , NULL);
+    glCompileShader(program->VertexShaderID);
     char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-    glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-    glCompileShader(FragmentShaderID);
-
-    // Check Fragment Shader
-    glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-    fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
-
-    // Link the program
-    fprintf(stdout, "Linking program\n");
-    GLuint ProgramID = glCreateProgram();
-    glAttachShader(ProgramID, VertexShaderID);
-    glAttachShader(ProgramID, FragmentShaderID);
-    glLinkProgram(ProgramID);
+    glShaderSource(program->FragmentShaderID, 1, &FragmentSourcePointer , NULL);
+    glCompileShader(program->FragmentShaderID);
+
+    // Linking right away is fine, a failed compile shows up as a failed link
+    program->ProgramID = glCreateProgram();
+    glAttachShader(program->ProgramID, program->VertexShaderID);
+    glAttachShader(program->ProgramID, program->FragmentShaderID);
+    if (program->use_cache)
+        glProgramParameteri(program->ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program->ProgramID);
+}
 
-    // Check the program
-    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-    glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-    glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-    fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+void printShaderLog (GLuint ShaderID, const char * kind)
+{
+    int InfoLogLength = 0;
+    glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if (InfoLogLength <= 1)
+        return;
+    std::vector<char> ShaderErrorMessage(InfoLogLength);
+    glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+    fprintf(stdout, "%s shader: %s\n", kind, &ShaderErrorMessage[0]);
+}
 
-    glDeleteShader(VertexShaderID);
-    glDeleteShader(FragmentShaderID);
+/* Checks the link result of a started program, waiting for the driver if it is not done yet */
+void finishShaderProgram (ShaderProgram* program)
+{
+    if (program->status != SHADER_PENDING)
+        return;
 
-    return ProgramID;
+    GLint Result = GL_FALSE;
+    int InfoLogLength = 0;
+    glGetProgramiv(program->ProgramID, GL_LINK_STATUS, &Result);
+    printShaderLog(program->VertexShaderID, "Vertex");
+    printShaderLog(program->FragmentShaderID, "Fragment");
+    glGetProgramiv(program->ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if (InfoLogLength > 1) {
+        std::vector<char> ProgramErrorMessage(InfoLogLength);
+        glGetProgramInfoLog(program->ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+        fprintf(stdout, "Linking %s: %s\n", program->name.c_str(), &ProgramErrorMessage[0]);
+    }
+
+    if (Result == GL_TRUE) {
+        program->status = SHADER_READY;
+        if (program->use_cache)
+            saveProgramBinary(program->cache_path.c_str(), program->cache_key, program->ProgramID);
+    }
+    else {
+        fprintf(stderr, "Program %s failed to link\n", program->name.c_str());
+        program->status = SHADER_FAILED;
+        glDeleteProgram(program->ProgramID);
+        program->ProgramID = 0;
+    }
+    glDeleteShader(program->VertexShaderID);
+    glDeleteShader(program->FragmentShaderID);
+}
+
+/* Non-blocking check, true once the program is ready or has failed */
+bool pollShaderProgram (ShaderProgram* program)
+{
+    if (program->status == SHADER_PENDING && GLAD_GL_ARB_parallel_shader_compile) {
+        GLint done = GL_FALSE;
+        glGetProgramiv(program->ProgramID, GL_COMPLETION_STATUS_ARB, &done);
+        if (!done)
+            return false;
+    }
+    finishShaderProgram(program);
+    return true;
+}
+
+/* Starts a program from shaders named as their files, binaries are cached as <vertex name>.bin
+   in programCacheDir().
+   The program is not added to the list polled by pollShaderPrograms */
+ShaderProgram* buildShaderProgram (const char * vertex_file_path, const char * fragment_file_path)
+{
+    static bool threads_set = false;
+    if (!threads_set && GLAD_GL_ARB_parallel_shader_compile)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);// let the driver pick
+    threads_set = true;
+
+    static std::string cache_dir = programCacheDir();
+    std::string cache_path = cache_dir.empty() ? "" : cache_dir + vertex_file_path + ".bin";
+
+    ShaderProgram* program = new ShaderProgram;
+    startShaderProgram(program, std::string(vertex_file_path) + " + " + fragment_file_path,
+            loadShaderSource(vertex_file_path), loadShaderSource(fragment_file_path), cache_path);
+    program->vertex_file = vertex_file_path;
+    program->fragment_file = fragment_file_path;
+    return program;
+}
+
+ShaderProgram* requestShaderProgram (const char * vertex_file_path, const char * fragment_file_path)
+{
+    ShaderProgram* program = buildShaderProgram(vertex_file_path, fragment_file_path);
+    shader_programs.push_back(program);
+    return program;
+}
+
+/* Frees a program from buildShaderProgram, finished or not */
+void discardShaderProgram (ShaderProgram* program)
+{
+    if (program->status == SHADER_PENDING) {
+        glDeleteShader(program->VertexShaderID);
+        glDeleteShader(program->FragmentShaderID);
+    }
+    if (program->ProgramID)
+        glDeleteProgram(program->ProgramID);
+    delete program;
+}
+
+/* Polls every requested program once, returns how many are still compiling */
+int pollShaderPrograms ()
+{
+    int pending = 0;
+    for (size_t i = 0; i < shader_programs.size(); i++)
+        if (!pollShaderProgram(shader_programs[i]))
+            pending++;
+    return pending;
 }
 
 static void error_callback(int error, const char* description)
@@ -137,13 +415,187 @@ void quit(GLFWwindow *window)
 }
 
 
+/* Render-state cache - skips GL calls that would set state which is already current */
+struct GLStateCache {
+    GLuint program;
+    GLuint vertexArray;
+    GLenum fillMode;
+
+    int issued;// state calls sent to GL this frame
+    int elided;// state calls skipped this frame
+    int drawCalls;
+    int lastIssued, lastElided, lastDrawCalls;// totals of the previous frame
+} StateCache = { 0, 0, GL_FILL };
+
+void cachedUseProgram (GLuint program)
+{
+    if (StateCache.program == program) {
+        StateCache.elided++;
+        return;
+    }
+    glUseProgram (program);
+    StateCache.program = program;
+    StateCache.issued++;
+}
+
+void cachedBindVertexArray (GLuint vertexArray)
+{
+    if (StateCache.vertexArray == vertexArray) {
+        StateCache.elided++;
+        return;
+    }
+    glBindVertexArray (vertexArray);
+    StateCache.vertexArray = vertexArray;
+    StateCache.issued++;
+}
+
+/* Deleting the bound VAO binds 0, and the name can come back from glGenVertexArrays */
+void cachedDeleteVertexArray (GLuint vertexArray)
+{
+    glDeleteVertexArrays (1, &vertexArray);
+    if (StateCache.vertexArray == vertexArray)
+        StateCache.vertexArray = 0;
+}
+
+void cachedPolygonMode (GLenum fillMode)
+{
+    if (StateCache.fillMode == fillMode) {
+        StateCache.elided++;
+        return;
+    }
+    glPolygonMode (GL_FRONT_AND_BACK, fillMode);
+    StateCache.fillMode = fillMode;
+    StateCache.issued++;
+}
+
+/* Called once per frame, keeps the counters of the finished frame for reporting */
+void resetStateCacheStats ()
+{
+    StateCache.lastIssued = StateCache.issued;
+    StateCache.lastElided = StateCache.elided;
+    StateCache.lastDrawCalls = StateCache.drawCalls;
+    StateCache.issued = StateCache.elided = StateCache.drawCalls = 0;
+}
+
+GLsizei vertexPositionSize (const VertexFormat& format)
+{
+    return format.position == POSITION_FLOAT ? 3*sizeof(GLfloat) : format.position == POSITION_HALF ? 4*sizeof(GLhalf) : sizeof(GLuint);
+}
+
+GLsizei vertexColorSize (const VertexFormat& format)
+{
+    return format.byteColors ? 4 : 3*sizeof(GLfloat);// bytes are padded to 4 for alignment
+}
+
+GLsizei vertexStride (const VertexFormat& format)
+{
+    return vertexPositionSize(format) + 2*vertexColorSize(format);// position, color, edge
+}
+
+/* Float to IEEE half, rounded to nearest - values too small for a normal half become 0 */
+GLhalf floatToHalf (GLfloat value)
+{
+    GLuint bits;
+    memcpy (&bits, &value, sizeof(bits));
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = bits & 0x7fffff;
+    if (exponent <= 0)
+        return sign;
+    if (exponent >= 31)
+        return sign | 0x7c00;
+    GLuint half = sign | (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000)
+        half++;// a carry into the exponent still rounds correctly
+    return half;
+}
+
+GLubyte floatToUnorm8 (GLfloat value)
+{
+    return (GLubyte) (max(0.0f, min(1.0f, value))*255.0f + 0.5f);
+}
+
+/* Encodes vertices in format, returns a pointer to the data to upload */
+const void* packVertices (const VertexFormat& format, int numVertices, const Vertex* vertex_data, vector<GLubyte>& packed)
+{
+    if (format.position == POSITION_FLOAT && !format.byteColors)
+        return vertex_data;
+    GLsizei position_size = vertexPositionSize(format), color_size = vertexColorSize(format);
+    packed.assign (numVertices*vertexStride(format), 0);
+    GLubyte* out = packed.empty() ? NULL : &packed[0];
+    for (int i=0; i<numVertices; i++) {
+        const Vertex& v = vertex_data[i];
+        if (format.position == POSITION_FLOAT)
+            memcpy (out, v.position, position_size);
+        else if (format.position == POSITION_HALF) {
+            GLhalf half[4] = { floatToHalf(v.position[0]), floatToHalf(v.position[1]), floatToHalf(v.position[2]), 0 };
+            memcpy (out, half, position_size);
+        }
+        else {
+            GLuint word = 0;
+            for (int c=0; c<3; c++) {
+                int step = (int) floor (v.position[c]/format.scale + 0.5f);
+                word |= (GLuint)(max(-511, min(511, step)) & 0x3ff) << (10*c);
+            }
+            memcpy (out, &word, position_size);
+        }
+        out += position_size;
+
+        if (format.byteColors)
+            for (int c=0; c<3; c++) {
+                out[c] = floatToUnorm8(v.color[c]);
+                out[color_size + c] = floatToUnorm8(v.edge[c]);
+            }
+        else {
+            memcpy (out, v.color, color_size);
+            memcpy (out + color_size, v.edge, color_size);
+        }
+        out += 2*color_size;
+    }
+    return packed.empty() ? NULL : &packed[0];
+}
+
+/* Point attributes 0, 1 (and 4) at the VBOs of vao - the caller binds the target VAO */
+void bindVertexAttributes (struct VAO* vao)
+{
+    // Interleaved meshes keep position, color and edge coordinates in one buffer
+    if (vao->ColorBuffer == vao->VertexBuffer) {
+        const VertexFormat& format = vao->Format;
+        GLsizei stride = vertexStride(format);
+        GLsizei color_offset = vertexPositionSize(format);
+        GLsizei edge_offset = color_offset + vertexColorSize(format);
+        GLenum color_type = format.byteColors ? GL_UNSIGNED_BYTE : GL_FLOAT;
+
+        glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+        if (format.position == POSITION_PACKED)
+            glVertexAttribPointer(0, 4, GL_INT_2_10_10_10_REV, GL_FALSE, stride, (void*)0);// w is 0 and unused
+        else
+            glVertexAttribPointer(0, 3, format.position == POSITION_HALF ? GL_HALF_FLOAT : GL_FLOAT, GL_FALSE, stride, (void*)0);
+        glVertexAttribPointer(1, 3, color_type, format.byteColors, stride, (void*)(intptr_t)color_offset);
+        // attribute 4 - outline, left disabled (reads 0) for the separate-buffer meshes
+        glVertexAttribPointer(4, 3, color_type, format.byteColors, stride, (void*)(intptr_t)edge_offset);
+        glEnableVertexAttribArray(4);
+    }
+    else {
+        glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    }
+    if (vao->IndexBuffer)
+        glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+}
+
 /* Generate VAO, VBOs and return VAO handle */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
+    vao->NumIndices = 0;
+    vao->IndexBuffer = 0;
     vao->FillMode = fill_mode;
+    vao->Format = FloatVertices;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
@@ -151,7 +603,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO 
     glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
@@ -174,6 +626,10 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
             (void*)0            // array buffer offset
             );
 
+    // Attribute enables are VAO state, so they only need to be set once
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
     return vao;
 }
 
@@ -190,27 +646,249 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
 }
 
+/* Generate VAO, one interleaved VBO and an index buffer and return VAO handle - the
+   vertices are stored in format */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const Vertex* vertex_data, int numIndices, const GLuint* index_data, GLenum fill_mode=GL_FILL, const VertexFormat& format=FloatVertices)
+{
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->NumIndices = numIndices;
+    vao->FillMode = fill_mode;
+    vao->Format = format;
+    vector<GLubyte> packed;
+
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - positions and colors
+    glGenBuffers (1, &(vao->IndexBuffer));  // IBO - triangle indices
+    vao->ColorBuffer = vao->VertexBuffer;
+
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, numVertices*vertexStride(format), packVertices(format, numVertices, vertex_data, packed), GL_STATIC_DRAW);
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer); // element buffer binding is stored in the VAO
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, numIndices*sizeof(GLuint), index_data, GL_STATIC_DRAW);
+    bindVertexAttributes(vao);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    return vao;
+}
+
+/* Replace the contents of an indexed VAO created by the overload above, possibly in another format */
+void update3DObject (struct VAO* vao, int numVertices, const Vertex* vertex_data, int numIndices, const GLuint* index_data, const VertexFormat& format=FloatVertices)
+{
+    vao->NumVertices = numVertices;
+    vao->NumIndices = numIndices;
+    vao->Format = format;
+    vector<GLubyte> packed;
+
+    cachedBindVertexArray (vao->VertexArrayID);
+    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, numVertices*vertexStride(format), packVertices(format, numVertices, vertex_data, packed), GL_STATIC_DRAW);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, numIndices*sizeof(GLuint), index_data, GL_STATIC_DRAW);
+    bindVertexAttributes (vao);// the stride and types follow the format
+}
+
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    cachedPolygonMode (vao->FillMode);
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    // Bind the VAO to use - it already holds the VBOs and enabled attributes
+    cachedBindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // Draw the geometry !
+    if (vao->IndexBuffer)
+        glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_INT, (void*)0);
+    else
+        glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    StateCache.drawCalls++;
+}
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+/* Draw list - per-object draws are queued with a sort key built from their GL state and
+   issued in key order, so draws sharing program, fill mode and VAO run back to back */
+struct DrawItem {
+    uint64_t key;
+    GLuint program;
+    struct VAO* vao;
+    GLuint vertexArray;// vao->VertexArrayID, or an instanced VAO over the same buffers
+    int instances;// 0 for a plain draw
+    GLfloat shm;// constant value of attribute 3 for plain draws
+    glm::mat4 model;
+};
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+struct DrawList {
+    vector<DrawItem> items;
+    vector<DrawItem> scratch;// radix sort buffer
+} Draws;
+
+/* Program changes cost the most so it takes the top bits, then fill mode, then the VAO */
+uint64_t drawSortKey (GLuint program, GLenum fillMode, GLuint vertexArray)
+{
+    uint64_t fill = fillMode == GL_FILL ? 0 : fillMode == GL_LINE ? 1 : 2;
+    return ((uint64_t)(program & 0xffff) << 48) | (fill << 40) | vertexArray;
+}
+
+void submitDraw (GLuint program, struct VAO* vao, const glm::mat4& model, GLfloat shm=0, GLuint vertexArray=0, int instances=0)
+{
+    DrawItem item;
+    item.program = program;
+    item.vao = vao;
+    item.vertexArray = vertexArray ? vertexArray : vao->VertexArrayID;
+    item.instances = instances;
+    item.shm = shm;
+    item.model = model;
+    item.key = drawSortKey (program, vao->FillMode, item.vertexArray);
+    Draws.items.push_back (item);
+}
+
+/* Stable LSD radix sort on the key, 8 bits per pass. Passes where every key has the
+   same byte are skipped, which is most of them with a handful of programs and VAOs */
+void sortDrawList ()
+{
+    vector<DrawItem>& items = Draws.items;
+    vector<DrawItem>& scratch = Draws.scratch;
+    scratch.resize (items.size());
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[256] = {0};
+        for (size_t i = 0; i < items.size(); i++)
+            count[(items[i].key >> shift) & 0xff]++;
+        if (items.empty() || count[(items[0].key >> shift) & 0xff] == items.size())
+            continue;
+        size_t start[256];
+        for (int b = 0, total = 0; b < 256; b++) {
+            start[b] = total;
+            total += count[b];
+        }
+        for (size_t i = 0; i < items.size(); i++)
+            scratch[start[(items[i].key >> shift) & 0xff]++] = items[i];
+        items.swap (scratch);
+    }
+}
+
+/* Sorts and issues every queued draw through the state cache, then empties the list */
+void flushDrawList (GLuint ModelID)
+{
+    sortDrawList ();
+    const glm::mat4* model = NULL;
+    GLfloat shm = 0;
+    for (size_t i = 0; i < Draws.items.size(); i++) {
+        DrawItem& item = Draws.items[i];
+        if (item.program != StateCache.program)
+            model = NULL;// Model is per-program state
+        cachedUseProgram (item.program);
+        // neighbours after sorting often share the model matrix (identity for baked chunks)
+        if (model && memcmp (model, &item.model, sizeof(glm::mat4)) == 0)
+            StateCache.elided++;
+        else {
+            glUniformMatrix4fv (ModelID, 1, GL_FALSE, &item.model[0][0]);
+            StateCache.issued++;
+        }
+        model = &item.model;
+
+        if (item.instances == 0) {
+            if (item.shm != shm)
+                glVertexAttrib1f (3, item.shm);
+            shm = item.shm;
+            draw3DObject (item.vao);
+            continue;
+        }
+        cachedPolygonMode (item.vao->FillMode);
+        cachedBindVertexArray (item.vertexArray);
+        glDrawElementsInstanced (item.vao->PrimitiveMode, item.vao->NumIndices, GL_UNSIGNED_INT, (void*)0, item.instances);
+        StateCache.drawCalls++;
+    }
+    if (shm != 0)
+        glVertexAttrib1f (3, 0);
+    Draws.items.clear ();
+}
+
+/* Streaming buffer - STREAM_FRAMES regions of one persistently mapped buffer used as a ring.
+   Each frame writes the next region straight into GPU visible memory and fences it, the CPU
+   only waits when it comes back to a region the GPU may still be reading. Without
+   ARB_buffer_storage the data is uploaded with glBufferData into a fresh buffer store */
+#define STREAM_FRAMES 3
+struct StreamBuffer {
+    GLuint Buffer;
+    GLenum Target;
+    GLsizeiptr RegionSize;
+    char * Mapped;// NULL on the glBufferData fallback
+    GLsync Fences[STREAM_FRAMES];
+    int Region;// region written this frame
+};
+
+void createStreamBuffer (struct StreamBuffer* stream, GLenum target, GLsizeiptr region_size)
+{
+    stream->Target = target;
+    stream->RegionSize = region_size;
+    stream->Mapped = NULL;
+    stream->Region = 0;
+    for (int i=0; i<STREAM_FRAMES; i++)
+        stream->Fences[i] = 0;
+
+    glGenBuffers (1, &(stream->Buffer));
+    glBindBuffer (target, stream->Buffer);
+    if (GLAD_GL_ARB_buffer_storage) {
+        // coherent, so writes are visible to the GPU without explicit flushes
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage (target, STREAM_FRAMES*region_size, NULL, flags);
+        stream->Mapped = (char*) glMapBufferRange (target, 0, STREAM_FRAMES*region_size, flags);
+    }
+}
+
+/* Blocks until the GPU has finished with region i */
+void waitStreamRegion (struct StreamBuffer* stream, int i)
+{
+    if (!stream->Fences[i])
+        return;
+    while (glClientWaitSync (stream->Fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync (stream->Fences[i]);
+    stream->Fences[i] = 0;
+}
+
+/* Copies size bytes into this frame's region and returns their offset in stream->Buffer.
+   A region too small for the data is grown, which replaces stream->Buffer and sets *grown -
+   the new buffer can reuse the old name, so VAOs reading it have to be rebuilt on the flag */
+GLintptr writeStreamBuffer (struct StreamBuffer* stream, const void* data, GLsizeiptr size, bool* grown = NULL)
+{
+    if (grown)
+        *grown = false;
+    if (!stream->Mapped) {
+        glBindBuffer (stream->Target, stream->Buffer);
+        glBufferData (stream->Target, size, data, GL_STREAM_DRAW);
+        return 0;
+    }
+
+    if (size > stream->RegionSize) {
+        GLsizeiptr region_size = stream->RegionSize;
+        while (region_size < size)
+            region_size *= 2;
+        for (int i=0; i<STREAM_FRAMES; i++)
+            waitStreamRegion (stream, i);
+        glBindBuffer (stream->Target, stream->Buffer);
+        glUnmapBuffer (stream->Target);
+        glDeleteBuffers (1, &(stream->Buffer));
+        createStreamBuffer (stream, stream->Target, region_size);
+        if (grown)
+            *grown = true;
+    }
+
+    waitStreamRegion (stream, stream->Region);
+    GLintptr offset = stream->Region*stream->RegionSize;
+    memcpy (stream->Mapped + offset, data, size);
+    return offset;
+}
+
+/* Fences this frame's region once the draws reading it are issued and moves to the next one */
+void advanceStreamBuffer (struct StreamBuffer* stream)
+{
+    if (!stream->Mapped)
+        return;
+    stream->Fences[stream->Region] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream->Region = (stream->Region + 1) % STREAM_FRAMES;
 }
 
 /**************************
@@ -219,12 +897,71 @@ void draw3DObject (struct VAO* vao)
 
 float triangle_rot_dir = 1;
 float rectangle_rot_dir = 1;
+float rectangle_rotation = 0;
 bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
+bool use_instancing = true;//I toggles between instanced and per-tile block drawing
+bool show_render_stats = false;//S prints draw and state call counts every 0.5s
+bool bake_static_tiles = true;//B toggles merging non-shm tiles into one static mesh
+bool merge_coplanar_faces = true;//M toggles greedy merging of top/bottom faces in baked meshes
+bool use_frustum_culling = true;//F toggles skipping chunks and objects outside the view
+bool use_indirect_draws = true;//D toggles the multi-draw indirect path where supported
+// V cycles the encoding of baked chunk meshes - 36, 16 or 12 bytes per vertex
+static const VertexFormat chunk_vertex_formats[3] = {
+    FloatVertices,
+    { POSITION_HALF, true, 1 },
+    { POSITION_PACKED, true, 0.05f },// chunk-local positions stay within +-17, 340 steps
+};
+int chunk_vertex_format = 2;
+bool tiles_dirty = false;// meshing mode changed, every chunk has to be remeshed
+
+/* Arrow key press waiting for a tick, time is glfwGetTime() when GLFW delivered it */
+struct KeyEvent {
+    int move;// World.move value
+    double time;
+};
+
+/* Lock-free ring with one producer (keyboard) and one consumer (advance_world), so every press
+   reaches a tick and input could move to its own thread unchanged */
+#define INPUT_QUEUE_SIZE 64// power of two
+struct InputQueue {
+    KeyEvent events[INPUT_QUEUE_SIZE];
+    std::atomic<unsigned> head;// next event to take, only written by the consumer
+    std::atomic<unsigned> tail;// next free slot, only written by the producer
+    std::atomic<int> dropped;// presses lost because the queue was full, read by the stats printout
+} Input;
+
+bool push_input(InputQueue * queue, KeyEvent event)
+{
+    unsigned tail = queue->tail.load(std::memory_order_relaxed);
+    if (tail - queue->head.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+    {
+        queue->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    queue->events[tail & (INPUT_QUEUE_SIZE-1)] = event;
+    queue->tail.store(tail+1, std::memory_order_release);
+    return true;
+}
+
+bool pop_input(InputQueue * queue, KeyEvent * event)
+{
+    unsigned head = queue->head.load(std::memory_order_relaxed);
+    if (head == queue->tail.load(std::memory_order_acquire))
+        return false;
+    *event = queue->events[head & (INPUT_QUEUE_SIZE-1)];
+    queue->head.store(head+1, std::memory_order_release);
+    return true;
+}
+
+/* Time from a key press to the tick that applies it, printed with the S stats */
+struct InputLatency {
+    int moves;
+    double total, worst;
+} Latency;
 
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
-int pmov;
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     // Function is called first on GLFW_PRESS.
@@ -240,6 +977,30 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
             case GLFW_KEY_X:
                 // do something ..
                 break;
+            case GLFW_KEY_I:
+                use_instancing = !use_instancing;
+                break;
+            case GLFW_KEY_S:
+                show_render_stats = !show_render_stats;
+                break;
+            case GLFW_KEY_B:
+                bake_static_tiles = !bake_static_tiles;
+                tiles_dirty = true;
+                break;
+            case GLFW_KEY_F:
+                use_frustum_culling = !use_frustum_culling;
+                break;
+            case GLFW_KEY_V:
+                chunk_vertex_format = (chunk_vertex_format + 1) % 3;
+                tiles_dirty = true;
+                break;
+            case GLFW_KEY_D:
+                use_indirect_draws = !use_indirect_draws;
+                break;
+            case GLFW_KEY_M:
+                merge_coplanar_faces = !merge_coplanar_faces;
+                tiles_dirty = true;
+                break;
             default:
                 break;
         }
@@ -250,19 +1011,18 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 quit(window);
                 break;
             case GLFW_KEY_UP:
-                pmov=1;
+                push_input(&Input, { 1, glfwGetTime() });
                 break;       
             case GLFW_KEY_DOWN:
-                pmov=4;
+                push_input(&Input, { 4, glfwGetTime() });
                 break;       
             case GLFW_KEY_LEFT:
-                pmov=2;
+                push_input(&Input, { 2, glfwGetTime() });
                 break;       
             case GLFW_KEY_RIGHT:
-                pmov=3;
+                push_input(&Input, { 3, glfwGetTime() });
                 break;       
             default:
-                // pmov=0;
                 break;
         }
     }
@@ -300,15 +1060,10 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 }
 
 
-/* Executed when window is resized to 'width' and 'height' */
+/* Sets up viewport and projection for a framebuffer of fbwidth x fbheight pixels */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
+void resizeViewport (int fbwidth, int fbheight)
 {
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-       is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
-
     GLfloat fov = 90.0f;
 
     // sets the viewport of openGL renderer
@@ -324,328 +1079,941 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 
     // Ortho projection for 2D views
     Matrices.projection = glm::ortho(-25.0f,25.0f,-25.0f,25.0f,-25.0f,25.0f);
+    camera_dirty = true;
 }
-int block_count=0;
-block * barr[400];
 
-// Creates the rectangle object used in this sample code
-void createRectangle (block* platform)
+/* Executed when window is resized to 'width' and 'height' */
+void reshapeWindow (GLFWwindow* window, int width, int height)
 {
-    // GL3 accepts only Triangles. Quads are not supported
-    static const GLfloat vertex_buffer_data [] = {
-        -0.9,-0.9,1.05,
-        0.9,-0.9,1.05,
-        0.9,0.9,1.05,
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+       is different from WindowSize */
+    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    resizeViewport(fbwidth, fbheight);
+}
+/* View frustum as six planes (a,b,c,d), a point is inside when a*x+b*y+c*z+d >= 0.
+   The planes are extracted from VP, so this works for ortho and perspective projections */
+struct Frustum {
+    glm::vec4 planes[6];
+} ViewFrustum;
+
+struct CullStats {
+    int visible, culled;// this frame
+    int lastVisible, lastCulled;
+} Culling;
+
+void updateFrustum (const glm::mat4& VP)
+{
+    // rows of VP, glm matrices are indexed [column][row]
+    glm::vec4 row[4];
+    for (int i = 0; i < 4; i++)
+        row[i] = glm::vec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+    // left/right, bottom/top, near/far
+    for (int i = 0; i < 3; i++) {
+        ViewFrustum.planes[2*i] = row[3] + row[i];
+        ViewFrustum.planes[2*i + 1] = row[3] - row[i];
+    }
+}
 
-        0.9,0.9,1.05,
-        -0.9,0.9,1.05,
-        -0.9,-0.9,1.05,
+/* Axis aligned box test against ViewFrustum, counted in the cull stats */
+bool boxVisible (glm::vec3 lo, glm::vec3 hi)
+{
+    for (int i = 0; use_frustum_culling && i < 6; i++) {
+        const glm::vec4& p = ViewFrustum.planes[i];
+        // box corner furthest along the plane normal
+        glm::vec3 v (p.x > 0 ? hi.x : lo.x, p.y > 0 ? hi.y : lo.y, p.z > 0 ? hi.z : lo.z);
+        if (p.x*v.x + p.y*v.y + p.z*v.z + p.w < 0) {
+            Culling.culled++;
+            return false;
+        }
+    }
+    Culling.visible++;
+    return true;
+}
 
+void resetCullStats ()
+{
+    Culling.lastVisible = Culling.visible;
+    Culling.lastCulled = Culling.culled;
+    Culling.visible = Culling.culled = 0;
+}
 
-        1.05,-0.9,0.9,
-        1.05,-0.9,-0.9,
-        1.05,0.9,-0.9,
+/* Upload the Camera block - only the time field unless the camera changed */
+void updateCameraBlock (GLfloat time)
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    if (camera_dirty) {
+        CameraBlock camera;
+        camera.projection = Matrices.projection;
+        camera.view = Matrices.view;
+        camera.VP = Matrices.projection * Matrices.view;
+        camera.time = time;
+        updateFrustum (camera.VP);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(CameraBlock), &camera);
+        camera_dirty = false;
+    }
+    else
+        glBufferSubData(GL_UNIFORM_BUFFER, offsetof(CameraBlock, time), sizeof(GLfloat), &time);
+}
 
-        1.05,0.9,-0.9,
-        1.05,0.9,0.9,
-        1.05,-0.9,0.9,
+// Two triangles per face, faces are 4 consecutive vertices in +z,+x,-z,-x,+y,-y order
+static const GLuint cube_index_data [] = {
+    0,1,2, 2,3,0,
+    4,5,6, 6,7,4,
+    8,9,10, 10,11,8,
+    12,13,14, 14,15,12,
+    16,17,18, 18,19,16,
+    20,21,22, 22,23,20,
+};
 
+// Creates the rectangle object used in this sample code
+// GL3 accepts only Triangles. Quads are not supported - each face is 4 vertices indexed as 2 triangles
+// The black outline of every face is drawn by Sample_GL.frag from the edge coordinates
+static const Vertex ground_vertex_data [] = {
+    {{-1.0,-1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,0,0.05}},
+    {{1.0,-1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,0,0.05}},
+    {{1.0,1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,1,0.05}},
+    {{-1.0,1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,1,0.05}},
+
+    {{1.0,-1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,0,0.05}},
+    {{1.0,-1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,0,0.05}},
+    {{1.0,1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,1,0.05}},
+    {{1.0,1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,1,0.05}},
+
+    {{1.0,-1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,0,0.05}},
+    {{-1.0,-1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,0,0.05}},
+    {{-1.0,1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,1,0.05}},
+    {{1.0,1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,1,0.05}},
+
+    {{-1.0,-1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,0,0.05}},
+    {{-1.0,-1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,0,0.05}},
+    {{-1.0,1.0,1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {1,1,0.05}},
+    {{-1.0,1.0,-1.0}, {186.0/255.0,88.0/255.0,7.0/255.0}, {0,1,0.05}},
+
+    {{-1.0,1.0,1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {0,0,0.05}},
+    {{1.0,1.0,1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {1,0,0.05}},
+    {{1.0,1.0,-1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {1,1,0.05}},
+    {{-1.0,1.0,-1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {0,1,0.05}},
+
+    {{-1.0,-1.0,-1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {0,0,0.05}},
+    {{1.0,-1.0,-1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {1,0,0.05}},
+    {{1.0,-1.0,1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {1,1,0.05}},
+    {{-1.0,-1.0,1.0}, {11.0/255.0,97.0/255.0,7.0/255.0}, {0,1,0.05}},
+};
 
-        -0.9,-0.9,-1.05,
-        0.9,-0.9,-1.05,
-        0.9,0.9,-1.05,
+VAO * createRectangle ()
+{
+    // create3DObject creates and returns a handle to a VAO that can be used later
+    return create3DObject(GL_TRIANGLES, 24, ground_vertex_data, 36, cube_index_data, GL_FILL);
+}
+
+static const Vertex river_vertex_data [] = {
+    {{-1.0,-1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,-1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,0.8,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,0.8,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+
+    {{1.0,-1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,-1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,0.8,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,0.8,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+
+    {{1.0,-1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,-1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,0.8,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,0.8,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+
+    {{-1.0,-1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,-1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,0.8,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,0.8,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+
+    {{-1.0,1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+
+    {{-1.0,-1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,-1.0,-1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{1.0,-1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+    {{-1.0,-1.0,1.0}, {0.0,0.0,1.0}, {0,0,0}},
+};
 
-        0.9,0.9,-1.05,
-        -0.9,0.9,-1.05,
-        -0.9,-0.9,-1.05,
+VAO * create_river()
+{
+    return create3DObject(GL_TRIANGLES, 24, river_vertex_data, 36, cube_index_data, GL_FILL);
+}
 
+/* Mesh pool - a copy of every block, boat and player mesh in one vertex and one index
+   buffer, so the indirect path can draw all of them from a single VAO */
+struct PoolMesh {
+    GLuint count;// indices
+    GLuint firstIndex;
+    GLint baseVertex;
+};
 
-        -1.05,-0.9,0.9,
-        -1.05,-0.9,-0.9,
-        -1.05,0.9,-0.9,
+struct MeshPool {
+    vector<Vertex> vertices;
+    vector<GLuint> indices;
+    GLuint VertexBuffer;
+    GLuint IndexBuffer;
+    bool dirty;// meshes added since the last upload
+} Pool;
+
+/* Part of a buffer owned by one mesh, in vertices or indices */
+struct PoolRange {
+    GLuint first;
+    GLuint capacity;
+};
 
-        -1.05,0.9,-0.9,
-        -1.05,0.9,0.9,
-        -1.05,-0.9,0.9,
+PoolMesh add_pool_mesh(int numVertices, const Vertex* vertex_data, int numIndices, const GLuint* index_data)
+{
+    PoolMesh mesh;
+    mesh.count=numIndices;
+    mesh.firstIndex=Pool.indices.size();
+    mesh.baseVertex=Pool.vertices.size();
+    Pool.vertices.insert(Pool.vertices.end(), vertex_data, vertex_data+numVertices);
+    Pool.indices.insert(Pool.indices.end(), index_data, index_data+numIndices);
+    Pool.dirty=true;
+    return mesh;
+}
 
+/* Non-indexed mesh with separate position and color arrays, indexed 0..numVertices-1 */
+PoolMesh add_pool_mesh(int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+    vector<Vertex> vertices(numVertices);
+    vector<GLuint> indices(numVertices);
+    for(int i=0;i<numVertices;i++)
+    {
+        for(int c=0;c<3;c++)
+        {
+            vertices[i].position[c]=vertex_buffer_data[3*i+c];
+            vertices[i].color[c]=color_buffer_data[3*i+c];
+            vertices[i].edge[c]=0;
+        }
+        indices[i]=i;
+    }
+    return add_pool_mesh(numVertices, &vertices[0], numVertices, &indices[0]);
+}
 
-        -0.9,1.05,0.9,
-        0.9,1.05,0.9,
-        0.9,1.05,-0.9,
+/* Mesh registry - one set of VAOs per block type, shared by every tile of that type */
+#define BLOCK_TYPES 2
+struct BlockMesh {
+    bool loaded;
+    VAO * cube;
+    const Vertex * cube_vertices;// CPU copy for baking, 24 vertices indexed by cube_index_data
+    PoolMesh pooled;// the same mesh in Pool, count 0 when there is none
+};
+BlockMesh block_meshes[BLOCK_TYPES];
 
-        0.9,1.05,-0.9,
-        -0.9,1.05,-0.9,
-        -0.9,1.05,0.9,
+/* Returns the meshes for a block type, creating them on first use */
+BlockMesh * get_block_mesh(int type)
+{
+    BlockMesh * mesh=&block_meshes[type];
+    if(!mesh->loaded)
+    {
+        mesh->cube=NULL;
+        mesh->cube_vertices=NULL;
+        mesh->pooled.count=0;
+        if(type==0)
+        {
+            mesh->cube=createRectangle();
+            mesh->cube_vertices=ground_vertex_data;
+        }
+        else if(type==1)
+        {
+            mesh->cube=create_river();
+            mesh->cube_vertices=river_vertex_data;
+        }
+        if(mesh->cube_vertices)
+            mesh->pooled=add_pool_mesh(24, mesh->cube_vertices, 36, cube_index_data);
+        mesh->loaded=true;
+    }
+    return mesh;
+}
 
+/* Instanced tile path - one instance buffer per block type holding every tile's offset,
+   drawn with one glDrawElementsInstanced per mesh instead of one draw per tile */
+struct TileInstance {
+    GLfloat offset[3];// attribute 2 in Sample_GL.vert
+    GLfloat shm;      // attribute 3, 1 for bobbing tiles
+};
 
-        -0.9,-1.05,0.9,
-        0.9,-1.05,0.9,
-        0.9,-1.05,-0.9,
+struct TileBatch {
+    GLuint InstanceBuffer;
+    GLuint CubeArrayID;  // VAO over the shared mesh VBOs plus the instance buffer
+    int NumInstances;
+};
 
-        0.9,-1.05,-0.9,
-        -0.9,-1.05,-0.9,
-        -0.9,-1.05,0.9,        
-    };
+/* The mesh VAOs are also drawn one tile at a time, so the instance attributes go on a separate VAO */
+GLuint create_instanced_array(VAO * mesh, GLuint instance_buffer)
+{
+    GLuint array_id;
+    glGenVertexArrays(1, &array_id);
+    cachedBindVertexArray(array_id);
 
-    static const GLfloat color_buffer_data [] = {
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-        186.0/255.0,88.0/255.0,7.0/255.0, // color 1
-
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-        11.0/255.0,97.0/255.0,7.0/255.0, // color 1
-    };
-    printf("hi\n");
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    platform->cube = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
+    bindVertexAttributes(mesh);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
 
-void create_rect_border(block * platform)
-{ 
-    static const GLfloat vertex_buffer_data [] = {
-        -1.0,-1.0,1.0,
-        1.0,-1.0,1.0,
-        1.0,1.0,1.0,
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)0);
+    glVertexAttribDivisor(2, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)(3*sizeof(GLfloat)));
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
 
-        1.0,1.0,1.0,
-        -1.0,1.0,1.0,
-        -1.0,-1.0,1.0,
+    cachedBindVertexArray(0);
+    return array_id;
+}
 
+/* Block world - tiles live in CHUNK_SIZE x CHUNK_SIZE chunks, each with its own baked mesh
+   and instance buffers. Editing a tile only marks its chunk dirty and only dirty chunks
+   are remeshed before the next draw */
+#define CHUNK_SIZE 16
+
+struct Chunk {
+    int cx, cz;// holds tiles cx*CHUNK_SIZE .. cx*CHUNK_SIZE+CHUNK_SIZE-1 in x, same for z
+    block * tiles[CHUNK_SIZE][CHUNK_SIZE];// [x][z], NULL where there is no tile
+    int tile_count;
+    VAO * static_mesh;// baked tiles for the per-object path, see build_chunk_static_mesh
+    vector<Vertex> baked_vertices;// the same tiles as floats, for Pool
+    vector<GLuint> baked_indices;
+    PoolRange vertex_range, index_range;// where the baked mesh lives in BakedPool
+    bool upload_pending;// static_mesh is older than baked_vertices
+    bool pool_pending;// the copy in BakedPool is older than baked_vertices
+    TileBatch batches[BLOCK_TYPES];// tiles that are not baked
+    vector<TileInstance> tile_instances[BLOCK_TYPES];// the same tiles, for the indirect path
+    bool dirty;
+};
+map<pair<int,int>, Chunk*> chunks;
+int block_count=0;
 
-        1.0,-1.0,1.0,
-        1.0,-1.0,-1.0,
-        1.0,1.0,-1.0,
+/* Chunk holding tile coordinate t, rounding down for negative coordinates */
+int chunk_coord(int t)
+{
+    return t>=0 ? t/CHUNK_SIZE : (t+1)/CHUNK_SIZE-1;
+}
 
-        1.0,1.0,-1.0,
-        1.0,1.0,1.0,
-        1.0,-1.0,1.0,
+Chunk * get_chunk(int x, int z, bool create)
+{
+    pair<int,int> key(chunk_coord(x), chunk_coord(z));
+    map<pair<int,int>, Chunk*>::iterator it=chunks.find(key);
+    if(it!=chunks.end())
+        return it->second;
+    if(!create)
+        return NULL;
+    Chunk * chunk=new Chunk();// value-initialised, no tiles and no GL objects yet
+    chunk->cx=key.first;
+    chunk->cz=key.second;
+    chunks[key]=chunk;
+    return chunk;
+}
 
+block ** chunk_slot(Chunk * chunk, int x, int z)
+{
+    return &chunk->tiles[x-chunk->cx*CHUNK_SIZE][z-chunk->cz*CHUNK_SIZE];
+}
 
-        1.0,-1.0,-1.0,
-        -1.0,-1.0,-1.0,
-        -1.0,1.0,-1.0,
+block * get_block(int x, int z)
+{
+    Chunk * chunk=get_chunk(x, z, false);
+    return chunk ? *chunk_slot(chunk, x, z) : NULL;
+}
 
-        -1.0,1.0,-1.0,
-        1.0,1.0,-1.0,
-        1.0,-1.0,-1.0,
+/* Marks the chunk of (x,z) dirty, plus the chunks of its neighbours since
+   their hidden faces depend on this tile */
+void touch_tile(int x, int z)
+{
+    static const int dx[5]={0,1,-1,0,0};
+    static const int dz[5]={0,0,0,1,-1};
+    for(int i=0;i<5;i++)
+    {
+        Chunk * chunk=get_chunk(x+dx[i], z+dz[i], false);
+        if(chunk)
+            chunk->dirty=true;
+    }
+}
 
+/* Creates the tile at (x,z) or changes its type */
+void set_block(int x, int z, int type)
+{
+    Chunk * chunk=get_chunk(x, z, true);
+    block ** slot=chunk_slot(chunk, x, z);
+    block * platform=*slot;
+    if(platform==NULL)
+    {
+        platform=(block *)malloc(sizeof(block));
+        platform->shm=false;
+        platform->x=x;
+        platform->z=z;
+        platform->y=0;
+        *slot=platform;
+        chunk->tile_count++;
+        block_count++;
+    }
+    BlockMesh * mesh=get_block_mesh(type);
+    platform->cube=mesh->cube;
+    platform->type=type;
+    touch_tile(x, z);
+}
 
-        -1.0,-1.0,-1.0,
-        -1.0,-1.0,1.0,
-        -1.0,1.0,1.0,
+void set_block_shm(int x, int z, bool shm)
+{
+    block * platform=get_block(x, z);
+    if(platform && platform->shm!=shm)
+    {
+        platform->shm=shm;
+        touch_tile(x, z);
+    }
+}
 
-        -1.0,1.0,1.0,
-        -1.0,1.0,-1.0,
-        -1.0,-1.0,-1.0,
+void remove_block(int x, int z)
+{
+    Chunk * chunk=get_chunk(x, z, false);
+    if(chunk==NULL || *chunk_slot(chunk, x, z)==NULL)
+        return;
+    free(*chunk_slot(chunk, x, z));
+    *chunk_slot(chunk, x, z)=NULL;
+    chunk->tile_count--;
+    block_count--;
+    touch_tile(x, z);
+}
 
+/* Static terrain - tiles without shm never move, so each chunk merges them into one
+   world-space mesh drawn with a single call and only rebuilt when the chunk changes */
+bool tile_is_baked(block * tile)
+{
+    return bake_static_tiles && !tile->shm;
+}
 
-        -1.0,1.0,1.0,
-        1.0,1.0,1.0,
-        1.0,1.0,-1.0,
+/* Appends a mesh transformed by model to a baked vertex/index list */
+void append_mesh(vector<Vertex> &vertices, vector<GLuint> &indices, const Vertex * mesh_vertices, int num_vertices, const GLuint * mesh_indices, int num_indices, glm::mat4 model)
+{
+    GLuint base=vertices.size();
+    for(int i=0;i<num_vertices;i++)
+    {
+        Vertex v=mesh_vertices[i];
+        glm::vec4 p=model*glm::vec4(v.position[0],v.position[1],v.position[2],1);
+        v.position[0]=p.x;
+        v.position[1]=p.y;
+        v.position[2]=p.z;
+        vertices.push_back(v);
+    }
+    for(int i=0;i<num_indices;i++)
+        indices.push_back(base+mesh_indices[i]);
+}
 
-        1.0,1.0,-1.0,
-        -1.0,1.0,-1.0,
-        -1.0,1.0,1.0,
+/* Faces in cube_index_data order (+z,+x,-z,-x,+y,-y) as tile offsets, the grid is one tile high */
+static const int face_dx[6]={0,1,0,-1,0,0};
+static const int face_dz[6]={1,0,-1,0,0,0};
+#define FACE_TOP 4
+#define FACE_BOTTOM 5
 
+/* A side face is never visible when a baked tile of the same type sits next to it */
+bool face_hidden(block * tile, int face)
+{
+    if(face_dx[face]==0 && face_dz[face]==0)
+        return false;
+    block * neighbour=get_block(tile->x+face_dx[face], tile->z+face_dz[face]);
+    return neighbour && neighbour->type==tile->type && tile_is_baked(neighbour);
+}
 
-        -1.0,-1.0,-1.0,
-        1.0,-1.0,-1.0,
-        1.0,-1.0,1.0,
+/* Horizontal face covering the whole tile without an outline, so neighbouring ones can be merged into one quad */
+bool face_mergeable(const Vertex * mesh_vertices, int face)
+{
+    if(face!=FACE_TOP && face!=FACE_BOTTOM)
+        return false;
+    for(int i=4*face;i<4*face+4;i++)
+        if(fabs(mesh_vertices[i].position[0])!=1 || fabs(mesh_vertices[i].position[2])!=1 || mesh_vertices[i].edge[2]!=0)
+            return false;
+    return true;
+}
 
-        1.0,-1.0,1.0,
-        -1.0,-1.0,1.0,
-        -1.0,-1.0,-1.0,    
-    };
+/* Appends one face of a cube mesh, stretched over tiles x0..x1, z0..z1 (world tile coordinates) */
+void append_face(vector<Vertex> &vertices, vector<GLuint> &indices, const Vertex * mesh_vertices, int face, int x0, int x1, int z0, int z1)
+{
+    GLuint base=vertices.size();
+    for(int i=4*face;i<4*face+4;i++)
+    {
+        Vertex v=mesh_vertices[i];
+        // tile-local extents run -1..1, so the corners land on the outer edges of the first and last tile
+        v.position[0]+= v.position[0]<0 ? 2*x0 : 2*x1;
+        v.position[2]+= v.position[2]<0 ? 2*z0 : 2*z1;
+        vertices.push_back(v);
+    }
+    for(int i=6*face;i<6*face+6;i++)
+        indices.push_back(base+cube_index_data[i]-4*face);
+}
 
-    static const GLfloat color_buffer_data [] = {
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-        0.0,0.0,0.0,
-    };
-    platform->cube_border = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+/* Greedy-merges one mergeable face of a block type mesh over all baked tiles of that type in the chunk */
+void append_merged_faces(vector<Vertex> &vertices, vector<GLuint> &indices, Chunk * chunk, int type, const Vertex * mesh_vertices, int face)
+{
+    bool mask[CHUNK_SIZE][CHUNK_SIZE];
+    for(int x=0;x<CHUNK_SIZE;x++)
+        for(int z=0;z<CHUNK_SIZE;z++)
+            mask[x][z]=chunk->tiles[x][z] && chunk->tiles[x][z]->type==type && tile_is_baked(chunk->tiles[x][z]);
+
+    for(int x=0;x<CHUNK_SIZE;x++)
+        for(int z=0;z<CHUNK_SIZE;z++)
+        {
+            if(!mask[x][z])
+                continue;
+            // grow along z, then along x while the whole row is still free
+            int w=1, h=1;
+            while(z+w<CHUNK_SIZE && mask[x][z+w])
+                w++;
+            for(bool full=true; full && x+h<CHUNK_SIZE; )
+            {
+                for(int k=z;k<z+w;k++)
+                    full=full && mask[x+h][k];
+                if(full)
+                    h++;
+            }
+            for(int i=x;i<x+h;i++)
+                for(int k=z;k<z+w;k++)
+                    mask[i][k]=false;
+
+            int tx=chunk->cx*CHUNK_SIZE+x, tz=chunk->cz*CHUNK_SIZE+z;
+            append_face(vertices, indices, mesh_vertices, face, tx, tx+h-1, tz, tz+w-1);
+        }
+}
+
+glm::vec3 chunk_centre(Chunk * chunk)
+{
+    return glm::vec3(2*chunk->cx*CHUNK_SIZE+CHUNK_SIZE-1, 0, 2*chunk->cz*CHUNK_SIZE+CHUNK_SIZE-1);
 }
-void create_river(block * platform)
+
+void build_chunk_static_mesh(Chunk * chunk)
 {
-    static const GLfloat vertex_buffer_data [] = {
-        -1.0,-1.0,1.0,
-        1.0,-1.0,1.0,
-        1.0,0.8,1.0,
+    vector<Vertex> vertices;
+    vector<GLuint> indices;
+    glm::mat4 rotate_tile = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0));
+    // face culling and merging assume tiles are axis aligned
+    bool cull_faces = rectangle_rotation==0;
+    for(int x=0;x<CHUNK_SIZE;x++)
+        for(int z=0;z<CHUNK_SIZE;z++)
+        {
+            block * tile=chunk->tiles[x][z];
+            if(tile==NULL || !tile_is_baked(tile))
+                continue;
+            const Vertex * mesh_vertices=get_block_mesh(tile->type)->cube_vertices;
+            if(mesh_vertices==NULL)
+                continue;
+            if(!cull_faces)
+            {
+                glm::mat4 model = glm::translate(glm::vec3(2*(tile->x),0,2*(tile->z))) * rotate_tile;
+                append_mesh(vertices, indices, mesh_vertices, 24, cube_index_data, 36, model);
+                continue;
+            }
+            for(int face=0;face<6;face++)
+                if(!face_hidden(tile, face) && !(merge_coplanar_faces && face_mergeable(mesh_vertices, face)))
+                    append_face(vertices, indices, mesh_vertices, face, tile->x, tile->x, tile->z, tile->z);
+        }
 
-        1.0,0.8,1.0,
-        -1.0,0.8,1.0,
-        -1.0,-1.0,1.0,
+    if(cull_faces && merge_coplanar_faces)
+        for(int type=0;type<BLOCK_TYPES;type++)
+        {
+            const Vertex * mesh_vertices=get_block_mesh(type)->cube_vertices;
+            for(int face=FACE_TOP;face<=FACE_BOTTOM;face++)
+                if(mesh_vertices && face_mergeable(mesh_vertices, face))
+                    append_merged_faces(vertices, indices, chunk, type, mesh_vertices, face);
+        }
 
+    // stored relative to the chunk centre, which keeps the compact formats in range
+    glm::vec3 centre=chunk_centre(chunk);
+    for(size_t i=0;i<vertices.size();i++)
+    {
+        vertices[i].position[0]-=centre.x;
+        vertices[i].position[2]-=centre.z;
+    }
 
-        1.0,-1.0,1.0,
-        1.0,-1.0,-1.0,
-        1.0,0.8,-1.0,
+    chunk->baked_vertices.swap(vertices);
+    chunk->baked_indices.swap(indices);
+    chunk->upload_pending=true;
+    chunk->pool_pending=true;
+}
 
-        1.0,0.8,-1.0,
-        1.0,0.8,1.0,
-        1.0,-1.0,1.0,
+/* Uploads the baked tiles in the current chunk_vertex_format, only the per-object path draws them */
+void upload_chunk_static_mesh(Chunk * chunk)
+{
+    const VertexFormat &format=chunk_vertex_formats[chunk_vertex_format];
+    const Vertex * vertex_data = chunk->baked_vertices.empty() ? NULL : &chunk->baked_vertices[0];
+    const GLuint * index_data = chunk->baked_indices.empty() ? NULL : &chunk->baked_indices[0];
+    if(chunk->static_mesh==NULL)
+        chunk->static_mesh=create3DObject(GL_TRIANGLES, chunk->baked_vertices.size(), vertex_data, chunk->baked_indices.size(), index_data, GL_FILL, format);
+    else
+        update3DObject(chunk->static_mesh, chunk->baked_vertices.size(), vertex_data, chunk->baked_indices.size(), index_data, format);
+    chunk->upload_pending=false;
+}
 
+/* Rebuilds the per-type instance lists and buffers of a chunk from the tiles that are not baked */
+void build_chunk_batches(Chunk * chunk)
+{
+    vector<TileInstance> * instances=chunk->tile_instances;
+    for(int type=0;type<BLOCK_TYPES;type++)
+        instances[type].clear();
+    for(int x=0;x<CHUNK_SIZE;x++)
+        for(int z=0;z<CHUNK_SIZE;z++)
+        {
+            block * tile=chunk->tiles[x][z];
+            if(tile==NULL || tile_is_baked(tile))
+                continue;
+            TileInstance instance;
+            instance.offset[0]=2*tile->x;
+            instance.offset[1]=0;
+            instance.offset[2]=2*tile->z;
+            instance.shm=tile->shm?1:0;
+            instances[tile->type].push_back(instance);
+        }
 
-        1.0,-1.0,-1.0,
-        -1.0,-1.0,-1.0,
-        -1.0,0.8,-1.0,
+    for(int type=0;type<BLOCK_TYPES;type++)
+    {
+        TileBatch * batch=&chunk->batches[type];
+        BlockMesh * mesh=get_block_mesh(type);
+        if(batch->InstanceBuffer==0)
+        {
+            glGenBuffers(1, &batch->InstanceBuffer);
+            if(mesh->cube)
+                batch->CubeArrayID=create_instanced_array(mesh->cube, batch->InstanceBuffer);
+        }
+        batch->NumInstances=instances[type].size();
+        glBindBuffer(GL_ARRAY_BUFFER, batch->InstanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, batch->NumInstances*sizeof(TileInstance),
+                batch->NumInstances ? &instances[type][0] : NULL, GL_STATIC_DRAW);
+    }
+}
 
-        -1.0,0.8,-1.0,
-        1.0,0.8,-1.0,
-        1.0,-1.0,-1.0,
+void rebuild_chunk(Chunk * chunk)
+{
+    build_chunk_static_mesh(chunk);
+    build_chunk_batches(chunk);
+    chunk->dirty=false;
+}
 
+void create_block(int j,int k,int type)
+{
+    set_block(j,k,type);
+}
 
-        -1.0,-1.0,-1.0,
-        -1.0,-1.0,1.0,
-        -1.0,0.8,1.0,
+/* Multi-draw indirect path - tiles, boat and player are queued as indirect commands over
+   the mesh pools and submitted with two glMultiDrawElementsIndirect calls per frame, one for
+   the baked chunks and one for everything else. Per-draw
+   offsets come from an instance stream addressed by baseInstance, so the number of GL calls
+   does not grow with the scene. Needs ARB_multi_draw_indirect and ARB_base_instance (core
+   in 4.3), draw() keeps the per-object path when they are missing */
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
 
-        -1.0,0.8,1.0,
-        -1.0,0.8,-1.0,
-        -1.0,-1.0,-1.0,
+struct IndirectRenderer {
+    bool supported;
+    bool active;// this frame is drawn through the indirect path
+    GLuint VertexArrayID;// pool VBO/IBO plus the instance stream
+    StreamBuffer Instances;
+    StreamBuffer Commands;
+    vector<DrawElementsIndirectCommand> commands;
+    vector<TileInstance> instances;
+} Indirect;
+
+/* First-fit allocator over a buffer measured in vertices or indices - freed ranges are reused
+   before the end of the buffer moves */
+struct RangeAllocator {
+    vector<PoolRange> free;// sorted by first, neighbours merged
+    GLuint end;// nothing at or after end is handed out
+};
 
+PoolRange allocate_range(RangeAllocator * allocator, GLuint capacity)
+{
+    PoolRange range={0, capacity};
+    if(capacity==0)
+        return range;
+    for(size_t i=0;i<allocator->free.size();i++)
+    {
+        PoolRange &hole=allocator->free[i];
+        if(hole.capacity<capacity)
+            continue;
+        range.first=hole.first;
+        hole.first+=capacity;
+        hole.capacity-=capacity;
+        if(hole.capacity==0)
+            allocator->free.erase(allocator->free.begin()+i);
+        return range;
+    }
+    range.first=allocator->end;
+    allocator->end+=capacity;
+    return range;
+}
 
-        -1.0,1.0,1.0,
-        1.0,1.0,1.0,
-        1.0,1.0,-1.0,
+void free_range(RangeAllocator * allocator, PoolRange range)
+{
+    if(range.capacity==0)
+        return;
+    size_t i=0;
+    while(i<allocator->free.size() && allocator->free[i].first<range.first)
+        i++;
+    allocator->free.insert(allocator->free.begin()+i, range);
+    // merge with the following hole, then with the preceding one
+    if(i+1<allocator->free.size() && range.first+range.capacity==allocator->free[i+1].first)
+    {
+        allocator->free[i].capacity+=allocator->free[i+1].capacity;
+        allocator->free.erase(allocator->free.begin()+i+1);
+    }
+    if(i>0 && allocator->free[i-1].first+allocator->free[i-1].capacity==allocator->free[i].first)
+    {
+        allocator->free[i-1].capacity+=allocator->free[i].capacity;
+        allocator->free.erase(allocator->free.begin()+i);
+        i--;
+    }
+    // a hole at the end just gives the space back
+    if(allocator->free[i].first+allocator->free[i].capacity==allocator->end)
+    {
+        allocator->end=allocator->free[i].first;
+        allocator->free.erase(allocator->free.begin()+i);
+    }
+}
 
-        1.0,1.0,-1.0,
-        -1.0,1.0,-1.0,
-        -1.0,1.0,1.0,
+/* Baked chunk meshes of the indirect path - kept apart from Pool in buffers of their own, in the
+   chunk_vertex_format of the per-object path, and drawn with a second glMultiDrawElementsIndirect
+   whose Model scales packed positions back up. Every chunk owns a range of each buffer with some
+   room to grow, so rebaking a chunk uploads only that chunk and the buffers are only
+   reallocated when the ranges no longer fit */
+struct ChunkPool {
+    int format;// index into chunk_vertex_formats
+    VertexFormat Format;
+    GLuint VertexBuffer;
+    GLuint IndexBuffer;
+    GLuint VertexArrayID;// chunk buffers plus the instance stream
+    RangeAllocator vertices, indices;
+    GLuint vertex_capacity, index_capacity;// size of the GL buffers
+    vector<DrawElementsIndirectCommand> commands;
+} BakedPool;
+
+/* (Re)creates the pool VAOs, needed again whenever the instance stream or a chunk pool buffer
+   gets a new buffer */
+void create_indirect_array()
+{
+    if(Indirect.VertexArrayID)
+        cachedDeleteVertexArray(Indirect.VertexArrayID);
+    VAO pool_mesh;
+    pool_mesh.Format=FloatVertices;
+    pool_mesh.VertexBuffer=pool_mesh.ColorBuffer=Pool.VertexBuffer;
+    pool_mesh.IndexBuffer=Pool.IndexBuffer;
+    Indirect.VertexArrayID=create_instanced_array(&pool_mesh, Indirect.Instances.Buffer);
+
+    if(BakedPool.VertexArrayID)
+        cachedDeleteVertexArray(BakedPool.VertexArrayID);
+    VAO chunk_mesh;
+    chunk_mesh.Format=BakedPool.Format;
+    chunk_mesh.VertexBuffer=chunk_mesh.ColorBuffer=BakedPool.VertexBuffer;
+    chunk_mesh.IndexBuffer=BakedPool.IndexBuffer;
+    BakedPool.VertexArrayID=create_instanced_array(&chunk_mesh, Indirect.Instances.Buffer);
+}
 
+/* Moves the first used bytes of buffer into a new buffer of size bytes */
+void grow_pool_buffer(GLuint * buffer, GLsizeiptr used, GLsizeiptr size)
+{
+    GLuint grown;
+    glGenBuffers(1, &grown);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+    glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+    if(used)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, *buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+    }
+    glDeleteBuffers(1, buffer);
+    *buffer=grown;
+}
 
-        -1.0,-1.0,-1.0,
-        1.0,-1.0,-1.0,
-        1.0,-1.0,1.0,
+/* Makes the chunk pool buffers big enough for every allocated range */
+void reserve_baked_pool()
+{
+    bool grown=false;
+    if(BakedPool.vertices.end>BakedPool.vertex_capacity)
+    {
+        GLuint capacity=max(BakedPool.vertices.end, 2*BakedPool.vertex_capacity);
+        GLsizei stride=vertexStride(BakedPool.Format);
+        grow_pool_buffer(&BakedPool.VertexBuffer, BakedPool.vertex_capacity*stride, capacity*stride);
+        BakedPool.vertex_capacity=capacity;
+        grown=true;
+    }
+    if(BakedPool.indices.end>BakedPool.index_capacity)
+    {
+        GLuint capacity=max(BakedPool.indices.end, 2*BakedPool.index_capacity);
+        grow_pool_buffer(&BakedPool.IndexBuffer, BakedPool.index_capacity*sizeof(GLuint), capacity*sizeof(GLuint));
+        BakedPool.index_capacity=capacity;
+        grown=true;
+    }
+    if(grown)
+        create_indirect_array();
+}
 
-        1.0,-1.0,1.0,
-        -1.0,-1.0,1.0,
-        -1.0,-1.0,-1.0,    
-    };
+/* Copies a rebaked chunk into its ranges, moving it to larger ones when it has outgrown them */
+void upload_baked_chunk(Chunk * chunk)
+{
+    GLuint num_vertices=chunk->baked_vertices.size();
+    GLuint num_indices=chunk->baked_indices.size();
+    if(num_vertices>chunk->vertex_range.capacity || num_indices>chunk->index_range.capacity)
+    {
+        free_range(&BakedPool.vertices, chunk->vertex_range);
+        free_range(&BakedPool.indices, chunk->index_range);
+        // half as much again, so the next edits of this chunk still fit
+        chunk->vertex_range=allocate_range(&BakedPool.vertices, num_vertices+num_vertices/2);
+        chunk->index_range=allocate_range(&BakedPool.indices, num_indices+num_indices/2);
+        reserve_baked_pool();
+    }
 
-    static const GLfloat color_buffer_data [] = {
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-        0.0,0.0,1.0,
-    };
-    platform->cube_border = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+    // through GL_ARRAY_BUFFER so the element binding of the current VAO stays untouched
+    GLsizei stride=vertexStride(BakedPool.Format);
+    vector<GLubyte> packed;
+    if(num_vertices)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, BakedPool.VertexBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, chunk->vertex_range.first*stride, num_vertices*stride,
+                packVertices(BakedPool.Format, num_vertices, &chunk->baked_vertices[0], packed));
+    }
+    if(num_indices)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, BakedPool.IndexBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, chunk->index_range.first*sizeof(GLuint), num_indices*sizeof(GLuint), &chunk->baked_indices[0]);
+    }
+    chunk->pool_pending=false;
 }
 
-void create_block(int j,int k,int type)
+void init_indirect_renderer()
+{
+    Indirect.supported = GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance;
+    if(!Indirect.supported)
+        return;
+    glGenBuffers(1, &Pool.VertexBuffer);
+    glGenBuffers(1, &Pool.IndexBuffer);
+    BakedPool.format=chunk_vertex_format;
+    BakedPool.Format=chunk_vertex_formats[chunk_vertex_format];
+    glGenBuffers(1, &BakedPool.VertexBuffer);
+    glGenBuffers(1, &BakedPool.IndexBuffer);
+    // room for 4096 instances and 256 commands per frame, grown on demand
+    createStreamBuffer(&Indirect.Instances, GL_ARRAY_BUFFER, 4096*sizeof(TileInstance));
+    createStreamBuffer(&Indirect.Commands, GL_DRAW_INDIRECT_BUFFER, 256*sizeof(DrawElementsIndirectCommand));
+    create_indirect_array();
+}
+
+/* Queues instances of a pooled mesh, extending the previous command when it draws the same mesh */
+void queue_indirect(const PoolMesh &mesh, const TileInstance * instances, int count)
 {
-    block * platform=(block *)malloc(sizeof(block));
-    if(type==0)
+    if(mesh.count==0 || count==0)
+        return;
+    GLuint base_instance=Indirect.instances.size();
+    Indirect.instances.insert(Indirect.instances.end(), instances, instances+count);
+    if(!Indirect.commands.empty())
     {
-        createRectangle(platform);
-        create_rect_border(platform);
+        DrawElementsIndirectCommand &last=Indirect.commands.back();
+        if(last.firstIndex==mesh.firstIndex && last.baseInstance+last.instanceCount==base_instance)
+        {
+            last.instanceCount+=count;
+            return;
+        }
     }
-    else if(type==1)
+    DrawElementsIndirectCommand command={mesh.count, (GLuint)count, mesh.firstIndex, mesh.baseVertex, base_instance};
+    Indirect.commands.push_back(command);
+}
+
+/* Follows V - the ranges stay where they are and the vertex buffer is respecified for the new
+   stride, every chunk is uploaded again when it is next drawn */
+void update_baked_format()
+{
+    if(BakedPool.format==chunk_vertex_format)
+        return;
+    BakedPool.format=chunk_vertex_format;
+    BakedPool.Format=chunk_vertex_formats[chunk_vertex_format];
+    glBindBuffer(GL_ARRAY_BUFFER, BakedPool.VertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, BakedPool.vertex_capacity*vertexStride(BakedPool.Format), NULL, GL_STATIC_DRAW);
+    map<pair<int,int>, Chunk*>::iterator it;
+    for(it=chunks.begin();it!=chunks.end();it++)
+        it->second->pool_pending=true;
+    create_indirect_array();
+}
+
+/* Queues the baked mesh of a chunk, placed at the chunk centre by its instance */
+void queue_baked_chunk(Chunk * chunk)
+{
+    if(chunk->pool_pending)
+        upload_baked_chunk(chunk);
+    if(chunk->baked_indices.empty())
+        return;
+    glm::vec3 centre=chunk_centre(chunk);
+    TileInstance instance={{centre.x, centre.y, centre.z}, 0};
+    DrawElementsIndirectCommand command={(GLuint)chunk->baked_indices.size(), 1, chunk->index_range.first,
+        (GLint)chunk->vertex_range.first, (GLuint)Indirect.instances.size()};
+    Indirect.instances.push_back(instance);
+    BakedPool.commands.push_back(command);
+}
+
+/* Issues one multi-draw over the commands of this frame starting at command */
+void draw_indirect(GLuint vertex_array, GLintptr command_offset, size_t command, size_t count)
+{
+    if(count==0)
+        return;
+    glUniformMatrix4fv(Matrices.ModelID, 1, GL_FALSE, &Matrices.model[0][0]);
+    cachedBindVertexArray(vertex_array);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+            (void*)(command_offset+command*sizeof(DrawElementsIndirectCommand)), count, 0);
+    StateCache.drawCalls++;
+}
+
+/* Uploads the pool if needed and draws everything queued this frame, the baked chunks with
+   one call and the pooled meshes with another */
+void submit_indirect()
+{
+    // uploaded through GL_ARRAY_BUFFER so the element binding of the current VAO stays untouched
+    if(Pool.dirty)
     {
-        create_river(platform);
+        glBindBuffer(GL_ARRAY_BUFFER, Pool.VertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, Pool.vertices.size()*sizeof(Vertex), &Pool.vertices[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, Pool.IndexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, Pool.indices.size()*sizeof(GLuint), &Pool.indices[0], GL_STATIC_DRAW);
+        Pool.dirty=false;
     }
-    platform->x=j;
-    platform->z=k;
-    platform->y=0;
-    platform->type=type;
-    barr[block_count++]=platform;
+    if(Indirect.instances.empty())
+        return;
+
+    // both command lists go out in one write, the chunk commands first
+    vector<DrawElementsIndirectCommand> &commands=BakedPool.commands;
+    size_t baked=commands.size();
+    commands.insert(commands.end(), Indirect.commands.begin(), Indirect.commands.end());
+
+    bool grown;
+    GLintptr instance_offset=writeStreamBuffer(&Indirect.Instances, &Indirect.instances[0], Indirect.instances.size()*sizeof(TileInstance), &grown);
+    if(grown)
+        create_indirect_array();
+    // the VAOs read instances from the start of the buffer, so commands are shifted to this frame's region
+    GLuint first_instance=instance_offset/sizeof(TileInstance);
+    for(size_t i=0;i<commands.size();i++)
+        commands[i].baseInstance+=first_instance;
+    GLintptr command_offset=writeStreamBuffer(&Indirect.Commands, &commands[0], commands.size()*sizeof(DrawElementsIndirectCommand));
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, Indirect.Commands.Buffer);
+
+    // every offset comes from the instance stream
+    cachedPolygonMode(GL_FILL);
+    // packed chunk positions are in steps of Format.scale
+    Matrices.model = glm::scale(glm::vec3(BakedPool.Format.scale));
+    draw_indirect(BakedPool.VertexArrayID, command_offset, 0, baked);
+    Matrices.model = glm::mat4(1.0f);
+    draw_indirect(Indirect.VertexArrayID, command_offset, baked, commands.size()-baked);
+    advanceStreamBuffer(&Indirect.Instances);
+    advanceStreamBuffer(&Indirect.Commands);
+
+    BakedPool.commands.clear();
+    Indirect.commands.clear();
+    Indirect.instances.clear();
 }
 VAO * player;
-float player_pos[3];
+PoolMesh player_pooled;
 void create_player()
 {
     static const GLfloat vertex_buffer_data [] = {
@@ -695,12 +2063,11 @@ void create_player()
     };
 
     player = create3DObject(GL_TRIANGLES, 18, vertex_buffer_data, color_buffer_data, GL_FILL);
-    player_pos[0]=2;
-    player_pos[1]=2;
-    player_pos[2]=2;
+    player_pooled = add_pool_mesh(18, vertex_buffer_data, color_buffer_data);
 }
 
 VAO * boat;
+PoolMesh boat_pooled;
 void create_boat()
 {
     static const GLfloat vertex_buffer_data [] = {
@@ -723,15 +2090,26 @@ void create_boat()
     };
 
     boat = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    boat_pooled = add_pool_mesh(6, vertex_buffer_data, color_buffer_data);
 }
 
 
 float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
 float triangle_rotation = 0;
+float shm_omega=2;//bobbing of tiles with shm set, evaluated in Sample_GL.vert
+float shm_amp=1;
+GLuint ShmAmpID, ShmOmegaID;
+
+/* Scene time in seconds - headless runs advance a fixed 1/60s per frame so they are repeatable */
+bool headless = false;
+double headless_time = 0;
+double game_time()
+{
+    return headless ? headless_time : glfwGetTime();
+}
 /* Render the scene with openGL */
 /* Edit this function according to your assignment */
-void draw_block(int j,glm::mat4 MVP,glm::mat4 VP)
+void draw_block(block * block)
 {
     /* 
        int time = glfwGetTime();
@@ -741,122 +2119,310 @@ void draw_block(int j,glm::mat4 MVP,glm::mat4 VP)
      */
     // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
     // glPopMatrix ();
-    float omega=2;
-    float amp=1;
-    float shm_time=glfwGetTime();
-    block * block=barr[j];
     Matrices.model = glm::mat4(1.0f);
 
     glm::mat4 translate_rect_border = glm::translate (glm::vec3(2*(block->x),0,2*(block->z)));        // glTranslatef
     glm::mat4 rotate_rect_border = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
     Matrices.model *= (translate_rect_border * rotate_rect_border);
-    if(block->shm)
+
+    // bobbing is done in Sample_GL.vert, the shm flag goes in as the constant value of attribute 3
+    if(block->cube)
+        submitDraw(programID, block->cube, Matrices.model, block->shm ? 1 : 0);
+
+    return;
+}
+
+/* Queues the unbaked tiles of a chunk as one instanced draw per block type mesh */
+void draw_tile_batches(Chunk * chunk)
+{
+    // tile offsets come from the instance buffer, Model only carries the tile rotation
+    Matrices.model = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0));
+
+    for(int type=0;type<BLOCK_TYPES;type++)
     {
-        Matrices.model *= glm::translate(glm::vec3(0,amp*sin((shm_time)*omega),0));
+        TileBatch * batch=&chunk->batches[type];
+        BlockMesh * mesh=get_block_mesh(type);
+        if(batch->NumInstances==0)
+            continue;
+        if(mesh->cube)
+            submitDraw(programID, mesh->cube, Matrices.model, 0, batch->CubeArrayID, batch->NumInstances);
     }
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+}
 
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(block->cube);
+/* Frustum test of the chunk area, rebuilding the chunk when it is visible and dirty */
+bool prepare_chunk(Chunk * chunk)
+{
+    // whole chunk area, tiles may bob by shm_amp and reach up to 1.5 from their centre when rotated
+    glm::vec3 lo(2*chunk->cx*CHUNK_SIZE-1.5, -1.05-shm_amp, 2*chunk->cz*CHUNK_SIZE-1.5);
+    glm::vec3 hi(2*(chunk->cx*CHUNK_SIZE+CHUNK_SIZE-1)+1.5, 1.05+shm_amp, 2*(chunk->cz*CHUNK_SIZE+CHUNK_SIZE-1)+1.5);
+    if(!boxVisible(lo, hi))
+        return false;// remeshing of dirty chunks waits until they come into view
+
+    if(chunk->dirty)
+        rebuild_chunk(chunk);
+    // the indirect path draws the float copy in Pool instead
+    if(chunk->upload_pending && !Indirect.active)
+        upload_chunk_static_mesh(chunk);
+    return true;
+}
 
-    // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-    // glPopMatrix ();
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translateRectangle = translate_rect_border;        // glTranslatef
-    glm::mat4 rotateRectangle = rotate_rect_border; // rotate about vector (-1,1,1)
-    Matrices.model *= (translateRectangle * rotateRectangle);
-    if(block->shm)
+void draw_chunk(Chunk * chunk)
+{
+    if(!prepare_chunk(chunk))
+        return;
+
+    if(bake_static_tiles && chunk->static_mesh->NumIndices)
     {
-        Matrices.model*= glm::translate(glm::vec3(0,amp*sin((shm_time)*omega),0));
+        // baked relative to the chunk centre, packed positions are in steps of Format.scale
+        Matrices.model = glm::translate(chunk_centre(chunk)) * glm::scale(glm::vec3(chunk->static_mesh->Format.scale));
+        submitDraw(programID, chunk->static_mesh, Matrices.model);
     }
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]); 
 
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(block->cube_border);
+    // remaining (animated) tiles
+    if(use_instancing)
+        draw_tile_batches(chunk);
+    else
+    {
+        for(int x=0;x<CHUNK_SIZE;x++)
+            for(int z=0;z<CHUNK_SIZE;z++)
+                if(chunk->tiles[x][z] && !tile_is_baked(chunk->tiles[x][z]))
+                    draw_block(chunk->tiles[x][z]);
+    }
+}
 
-    return;
+/* Queues the baked mesh of every visible chunk, then its other tiles type by type so each
+   block type becomes one command */
+void queue_chunks_indirect()
+{
+    vector<Chunk*> visible;
+    map<pair<int,int>, Chunk*>::iterator chunk;
+    for(chunk=chunks.begin();chunk!=chunks.end();chunk++)
+    {
+        if(tiles_dirty)
+            chunk->second->dirty=true;
+        if(prepare_chunk(chunk->second))
+            visible.push_back(chunk->second);
+    }
+    update_baked_format();
+    for(size_t i=0;i<visible.size();i++)
+        queue_baked_chunk(visible[i]);
+    for(int type=0;type<BLOCK_TYPES;type++)
+        for(size_t i=0;i<visible.size();i++)
+        {
+            vector<TileInstance> &instances=visible[i]->tile_instances[type];
+            if(!instances.empty())
+                queue_indirect(get_block_mesh(type)->pooled, &instances[0], instances.size());
+        }
 }
 
-float boatx,boatz;
-void draw_player(glm::mat4 MVP,glm::mat4 VP)
+/* Queues an object placed by Matrices.model (a translation) on the draw list or the indirect path */
+void draw_object(VAO * vao, const PoolMesh &pooled)
 {
-    if(player_pos[1]<-1)
+    if(Indirect.active)
     {
-        printf("game over\n");
-        glfwTerminate();
-        exit(EXIT_SUCCESS);
+        TileInstance instance={{Matrices.model[3][0], Matrices.model[3][1], Matrices.model[3][2]}, 0};
+        queue_indirect(pooled, &instance, 1);
+        return;
     }
+    submitDraw(programID, vao, Matrices.model);
+}
 
-    Matrices.model = glm::mat4(1.0f);
+World world, previous_world;// previous_world is world one tick earlier, see game_logic.h
+double tick_hz = 60;// --tick-hz N
+double tick_accumulator = 0;// simulation time not yet ticked
+float render_alpha = 1;// how far draw() is from previous_world to world, 0..1
+InputRecorder recorder;// --record FILE
+InputReplay replay;// --replay FILE, its moves replace the keyboard
+bool replaying = false;
 
-    /*
-       glm::mat4 translate_rect_border = glm::translate (glm::vec3(0,2.3,0));        // glTranslatef
-       glm::mat4 rotate_rect_border = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-       Matrices.model *= (translate_rect_border * rotate_rect_border);
-     */
-    /*
-       if(pmov==1)
-       player_move = glm::translate(glm::vec3(2,0,0));
-       if(pmov==4)
-       player_move = glm::translate(glm::vec3(-2,0,0));
-       if(pmov==3)
-       player_move = glm::translate(glm::vec3(0,0,-2));
-       if(pmov==2)
-       player_move = glm::translate(glm::vec3(0,0,2));
-       else
-       player_move = glm::translate(glm::vec3(0,0,0));
-     */
-    if(player_pos[0]<0||player_pos[0]>=30||player_pos[2]>=20||player_pos[2]<0||(player_pos[0]>=12&&player_pos[0]<14&&player_pos[2]!=boatz))//drowning conditions
+/* Runs as many ticks as fit in elapsed seconds plus the leftover of earlier calls */
+void advance_world(double elapsed)
+{
+    // after a long stall (breakpoint, window drag) drop the time instead of catching up for seconds
+    tick_accumulator += min(elapsed, 0.25);
+    while(tick_accumulator >= 1/world.tick_hz && !world.game_over)
     {
-        player_pos[1]-=0.5;
+        previous_world=world;
+        int move = 0;
+        KeyEvent event;
+        if(replaying)
+            move = replay_input(&replay, world.tick);
+        // one press per tick, the next waits while the player is drowning and keeps world.move
+        else if(!world.move && pop_input(&Input, &event))
+        {
+            move = event.move;
+            double latency = glfwGetTime() - event.time;
+            Latency.moves++;
+            Latency.total += latency;
+            Latency.worst = max(Latency.worst, latency);
+        }
+        if(move)
+        {
+            world.move=move;
+            record_input(&recorder, world.tick, move, game_time());
+        }
+        update_world(&world);
+        tick_accumulator -= 1/world.tick_hz;
     }
-    else
+    render_alpha = min(1.0, tick_accumulator*world.tick_hz);
+}
+
+float interpolate(float previous, float current)
+{
+    return previous + (current-previous)*render_alpha;
+}
+
+void draw_player()
+{
+    glm::vec3 pos(interpolate(previous_world.player_pos[0], world.player_pos[0]),
+            interpolate(previous_world.player_pos[1], world.player_pos[1]),
+            interpolate(previous_world.player_pos[2], world.player_pos[2]));
+    if(!boxVisible(pos-glm::vec3(1,1,1), pos+glm::vec3(1,0,1)))
+        return;
+    Matrices.model = glm::translate(pos);
+    draw_object(player, player_pooled);
+}
+void draw_boat()
+{
+    float boatx=interpolate(previous_world.boatx, world.boatx);
+    float boatz=interpolate(previous_world.boatz, world.boatz);
+        if(!boxVisible(glm::vec3(boatx-1,1,boatz-1), glm::vec3(boatx+3,1,boatz+1)))
+            return;
+        Matrices.model = glm::mat4(1.0f);
+
+        glm::mat4 translate_boat = glm::translate (glm::vec3(boatx,0,boatz));        // glTranslatef
+        Matrices.model *= translate_boat;
+        draw_object(boat, boat_pooled);
+}
+
+/* Stand-in for Sample_GL while it compiles - same inputs and Camera block, no bobbing or outlines */
+static const char fallback_vertex_shader[] =
+    "#version 330 core\n"
+    "layout (location = 0) in vec3 vertexPosition;\n"
+    "layout (location = 1) in vec3 vertexColor;\n"
+    "layout (location = 2) in vec3 instanceOffset;\n"
+    "layout (std140) uniform Camera { mat4 Projection; mat4 View; mat4 VP; float Time; };\n"
+    "uniform mat4 Model;\n"
+    "out vec3 fragColor;\n"
+    "void main () {\n"
+    "    fragColor = vertexColor;\n"
+    "    gl_Position = VP * (Model * vec4(vertexPosition, 1) + vec4(instanceOffset, 0));\n"
+    "}\n";
+static const char fallback_fragment_shader[] =
+    "#version 330 core\n"
+    "in vec3 fragColor;\n"
+    "out vec3 color;\n"
+    "void main () { color = fragColor; }\n";
+
+ShaderProgram * scene_program;// Sample_GL, possibly still compiling
+GLuint fallback_program;// drawn with until scene_program has linked, 0 once it is deleted
+
+/* Makes program the one the scene is drawn with and looks up its uniforms */
+void use_scene_program(GLuint program)
+{
+    programID = program;
+    // Get a handle for our "Model" uniform
+    Matrices.ModelID = glGetUniformLocation(programID, "Model");
+    // Camera block is fed from one uniform buffer updated once per frame
+    glUniformBlockBinding(programID, glGetUniformBlockIndex(programID, "Camera"), CAMERA_BINDING);
+    // -1 in the fallback program, glUniform ignores those
+    ShmAmpID = glGetUniformLocation(programID, "ShmAmp");
+    ShmOmegaID = glGetUniformLocation(programID, "ShmOmega");
+}
+
+/* Shader hot reload - with SHADER_DIR set that directory is watched with inotify. A changed
+   shader starts a new build of the scene program next to the running one, which keeps
+   drawing until the new build has linked. A build that fails is dropped. Only done with
+   ARB_parallel_shader_compile - without it compiling and linking stall the frame they run in */
+struct ShaderWatch {
+    int fd;// -1 when not watching
+    ShaderProgram * pending;// build of the changed shaders, NULL when there is none
+} Watch = { -1, NULL };
+
+void watch_shaders()
+{
+#ifdef __linux__
+    const char * shader_dir = getenv("SHADER_DIR");
+    if(shader_dir==NULL)
+        return;
+    if(!GLAD_GL_ARB_parallel_shader_compile)
     {
-        if(pmov==3)
-            player_pos[0]+=2;
-        if(pmov==2)
-            player_pos[0]-=2;
-        if(pmov==4)
-            player_pos[2]+=2;
-        if(pmov==1)
-            player_pos[2]-=2;
-        pmov=0; 
-    }
-    Matrices.model *= glm::translate(glm::vec3(player_pos[0],player_pos[1],player_pos[2]));
-    player_pos[0]=Matrices.model[3][0];
-    player_pos[1]=Matrices.model[3][1];
-    player_pos[2]=Matrices.model[3][2];
-
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(player);
-}
-void draw_boat(glm::mat4 VP,glm::mat4 MVP)
-{
-    int a = glfwGetTime();
-    if(a%10==0)
+        printf("No ARB_parallel_shader_compile, shaders are read from %s at startup only\n", shader_dir);
+        return;
+    }
+    Watch.fd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // editors often save by writing a new file and renaming it over the old one
+    if(Watch.fd>=0 && inotify_add_watch(Watch.fd, shader_dir, IN_CLOSE_WRITE | IN_MOVED_TO)<0)
     {
-        boatx=12;
-        boatz=0;
+        close(Watch.fd);
+        Watch.fd=-1;
     }
-    else
+    if(Watch.fd>=0)
+        printf("Watching %s for shader changes\n", shader_dir);
+#endif
+}
+
+/* Drains the inotify queue without blocking, true if a shader of program was written */
+bool shaders_changed(ShaderProgram * program)
+{
+    bool changed=false;
+#ifdef __linux__
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while((length=read(Watch.fd, buffer, sizeof(buffer)))>0)
     {
-        
-        boatz=a%10 * 2;
+        const struct inotify_event * event;
+        for(char * p=buffer; p<buffer+length; p+=sizeof(struct inotify_event)+event->len)
+        {
+            event=(const struct inotify_event *)p;
+            if(event->len && (program->vertex_file==event->name || program->fragment_file==event->name))
+                changed=true;
+        }
     }
-        Matrices.model = glm::mat4(1.0f);
+#endif
+    return changed;
+}
 
-        glm::mat4 translate_boat = glm::translate (glm::vec3(boatx,0,boatz));        // glTranslatef
-        Matrices.model *= translate_boat;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Called once per frame - starts, polls and swaps in rebuilds of the scene program */
+void reload_shaders()
+{
+    if(Watch.fd<0)
+        return;
+    if(shaders_changed(scene_program))
+    {
+        // a newer edit supersedes a build still in progress
+        if(Watch.pending)
+            discardShaderProgram(Watch.pending);
+        Watch.pending=buildShaderProgram(scene_program->vertex_file.c_str(), scene_program->fragment_file.c_str());
+    }
+    if(Watch.pending==NULL)
+        return;
+    if(!pollShaderProgram(Watch.pending))
+        return;
 
-        // draw3DObject draws the VAO given to it using current MVP matrix
-        draw3DObject(boat);
+    if(Watch.pending->status==SHADER_READY)
+    {
+        // scene_program stays the same object, so the program list keeps pointing at it
+        GLuint old=scene_program->ProgramID;
+        if(scene_program->status==SHADER_PENDING)
+        {
+            glDeleteShader(scene_program->VertexShaderID);
+            glDeleteShader(scene_program->FragmentShaderID);
+        }
+        *scene_program=*Watch.pending;
+        delete Watch.pending;
+        if(programID==old)
+            use_scene_program(scene_program->ProgramID);
+        if(old)
+            glDeleteProgram(old);
+        printf("Reloaded %s\n", scene_program->name.c_str());
+    }
+    else
+    {
+        printf("Keeping the running program\n");
+        discardShaderProgram(Watch.pending);
+    }
+    Watch.pending=NULL;
 }
 
 void draw ()
@@ -864,40 +2430,73 @@ void draw ()
     // clear the color and depth in the frame buffer
     glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // use the loaded shader program
-    // Don't change unless you know what you are doing
-    glUseProgram (programID);
+    resetStateCacheStats();
+    resetCullStats();
 
-    // Eye - Location of camera. Don't change unless you are sure!!
-    // glm::vec3 eye ( 10*cos(camera_rotation_angle*M_PI/180.0f), 3, 10*sin(camera_rotation_angle*M_PI/180.0f) );
-    // Target - Where is the camera looking at.  Don't change unless you are sure!!
-    glm::vec3 eye (5,5,5);
-    glm::vec3 target (5, 0, 0);
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-    glm::vec3 up (0, 0, -1);
+    reload_shaders();
+    // switch from the fallback program as soon as Sample_GL has linked
+    if (pollShaderPrograms() == 0 && scene_program->ProgramID && programID != scene_program->ProgramID) {
+        use_scene_program (scene_program->ProgramID);
+        if (fallback_program)
+            glDeleteProgram (fallback_program);
+        fallback_program = 0;
+    }
 
-    // Compute Camera matrix (view)
-    Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    //  Don't change unless you are sure!!
-    //  Matrices.view = glm::lookAt(glm::vec3(5,1,10) glm::vec3(5,0,0), glm::vec3(0,0,1)); // Fixed camera for 2D (ortho) in XY plane
+    // use the loaded shader program
+    // Don't change unless you know what you are doing
+    cachedUseProgram (programID);
+
+    // The camera is static, so view and VP are only rebuilt when the projection changes
+    if (camera_dirty) {
+        // Eye - Location of camera. Don't change unless you are sure!!
+        // glm::vec3 eye ( 10*cos(camera_rotation_angle*M_PI/180.0f), 3, 10*sin(camera_rotation_angle*M_PI/180.0f) );
+        // Target - Where is the camera looking at.  Don't change unless you are sure!!
+        glm::vec3 eye (5,5,5);
+        glm::vec3 target (5, 0, 0);
+        // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+        glm::vec3 up (0, 0, -1);
+
+        // Compute Camera matrix (view)
+        Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+        //  Don't change unless you are sure!!
+        //  Matrices.view = glm::lookAt(glm::vec3(5,1,10) glm::vec3(5,0,0), glm::vec3(0,0,1)); // Fixed camera for 2D (ortho) in XY plane
+    }
+    updateCameraBlock ((GLfloat) game_time());
 
-    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-    //  Don't change unless you are sure!!
-    glm::mat4 VP = Matrices.projection * Matrices.view;
+    // tile bobbing parameters, the oscillation itself runs in the vertex shader
+    glUniform1f(ShmAmpID, shm_amp);
+    glUniform1f(ShmOmegaID, shm_omega);
 
+    // the instance stream only carries offsets, so rotated tiles go through the per-object path
+    Indirect.active = use_indirect_draws && Indirect.supported && rectangle_rotation==0;
 
     //DRAW BLOCKS HERE...... 
-    glm::mat4 MVP;	// MVP = Projection * View * Model
-    int j;
-    int k;
-    for(j=0;j<block_count;j++)
-        draw_block(j,MVP,VP);
+    // MVP = VP (from the Camera block) * Model, computed in the vertex shader
+    if(Indirect.active)
+        queue_chunks_indirect();
+    else
+    {
+        map<pair<int,int>, Chunk*>::iterator chunk;
+        for(chunk=chunks.begin();chunk!=chunks.end();chunk++)
+        {
+            if(tiles_dirty)
+                chunk->second->dirty=true;
+            draw_chunk(chunk->second);
+        }
+    }
+    tiles_dirty=false;
 
     //DRAWING BOATS HERE
-    draw_boat(VP,MVP);
+    draw_boat();
 
     //Drawing player here
-    draw_player(MVP,VP);
+    draw_player();
+
+    // per-object draws go out sorted by state, the indirect path in its single call
+    if(Indirect.active)
+        submit_indirect();
+    else
+        flushDrawList(Matrices.ModelID);
 
 
     // Increment angles
@@ -955,8 +2554,86 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+#ifdef HEADLESS
+/* Headless backend - an EGL context without any surface (Mesa's surfaceless platform,
+   llvmpipe when there is no GPU) renders draw() into an FBO, so the renderer can be
+   benchmarked without a display. Build with -DHEADLESS and link with -lEGL */
+struct HeadlessTarget {
+    EGLDisplay display;
+    EGLContext context;
+    GLuint Framebuffer;
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
+} Headless;
+
+bool initHeadless (int width, int height)
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        fprintf(stderr, "headless: no EGL display\n");
+        return false;
+    }
+
+    const EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+        fprintf(stderr, "headless: no desktop GL config\n");
+        return false;
+    }
+
+    // same context as initGLFW asks for
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+        EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+        EGL_NONE
+    };
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    // no surface at all, needs EGL_KHR_surfaceless_context
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        fprintf(stderr, "headless: cannot create a surfaceless GL 3.3 core context\n");
+        return false;
+    }
+    Headless.display = display;
+    Headless.context = context;
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // the default framebuffer does not exist, draw() renders into this one instead
+    glGenFramebuffers(1, &Headless.Framebuffer);
+    glGenRenderbuffers(1, &Headless.ColorBuffer);
+    glGenRenderbuffers(1, &Headless.DepthBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, Headless.Framebuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Headless.ColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Headless.ColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Headless.DepthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Headless.DepthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "headless: incomplete framebuffer\n");
+        return false;
+    }
+    return true;
+}
+
+void quitHeadless ()
+{
+    eglMakeCurrent(Headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(Headless.display, Headless.context);
+    eglTerminate(Headless.display);
+}
+#endif
+
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
+/* window is NULL in headless mode */
 void initGL (GLFWwindow* window, int width, int height)
 {
     /* Objects should be created before any other gl function and shaders */
@@ -970,13 +2647,34 @@ void initGL (GLFWwindow* window, int width, int height)
                 create_block(j,k,1);
     create_boat();
     create_player();
-    // Create and compile our GLSL program from the shaders
-    programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-    // Get a handle for our "MVP" uniform
-    Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+    init_world(&world, tick_hz);
+    previous_world = world;
+    // Start compiling our GLSL program from the shaders
+    scene_program = requestShaderProgram( "Sample_GL.vert", "Sample_GL.frag" );
+    // Only worth a fallback when the driver really compiles in the background
+    if (scene_program->status == SHADER_PENDING && GLAD_GL_ARB_parallel_shader_compile) {
+        ShaderProgram fallback;
+        startShaderProgram(&fallback, "fallback", fallback_vertex_shader, fallback_fragment_shader, "");
+        finishShaderProgram(&fallback);
+        fallback_program = fallback.ProgramID;
+        use_scene_program(fallback_program);
+    }
+    else {
+        finishShaderProgram(scene_program);
+        use_scene_program(scene_program->ProgramID);
+    }
+    watch_shaders();
+    glGenBuffers(1, &Matrices.CameraBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, Matrices.CameraBuffer);
+    init_indirect_renderer();
 
 
-    reshapeWindow (window, width, height);
+    if (window)
+        reshapeWindow (window, width, height);
+    else
+        resizeViewport (width, height);
 
     // Background color of the scene
     glClearColor (102.0/255.0, 224.0/255.0, 255.0/255.0, 0.0f); // R, G, B, A
@@ -991,19 +2689,92 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+#ifdef HEADLESS
+/* Renders frames frames offscreen as fast as possible and prints the timing */
+int runHeadless (int frames, int width, int height)
+{
+    headless = true;
+    if (!initHeadless(width, height))
+        return EXIT_FAILURE;
+    initGL (NULL, width, height);
+    glFinish ();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        headless_time = i/60.0;
+        advance_world(1/60.0);
+        draw();
+    }
+    glFinish ();// wait for the GPU so the time covers the rendering too
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    printf("%d frames in %.3f s, %.3f ms/frame\n", frames, seconds, frames ? 1000*seconds/frames : 0);
+    printf("last frame - draws: %d  state calls: %d issued, %d elided  objects: %d visible, %d culled\n",
+            StateCache.drawCalls, StateCache.issued, StateCache.elided, Culling.visible, Culling.culled);
+    stop_recording(&recorder);
+    quitHeadless ();
+    return EXIT_SUCCESS;
+}
+#endif
+
 int main (int argc, char** argv)
 {
     int width = 600;
     int height = 600;
 
+    int headless_frames = 0;
+    const char * record_path = NULL;
+    const char * replay_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tick-hz") == 0 && i+1 < argc)
+            tick_hz = max(1.0, atof(argv[++i]));
+        else if (strcmp(argv[i], "--record") == 0 && i+1 < argc)
+            record_path = argv[++i];
+        // --replay FILE plays back a --record log at the tick rate it was recorded with
+        else if (strcmp(argv[i], "--replay") == 0 && i+1 < argc)
+            replay_path = argv[++i];
+        // --headless [frames] renders offscreen and exits, 600 frames by default
+        else if (strcmp(argv[i], "--headless") == 0)
+            headless_frames = i+1 < argc && atoi(argv[i+1]) > 0 ? atoi(argv[++i]) : 600;
+    }
+    // loaded after the other options so its tick rate wins over --tick-hz
+    if (replay_path && !load_input_log(replay_path, &tick_hz, &replay.events)) {
+        fprintf(stderr, "cannot read input log %s\n", replay_path);
+        exit(EXIT_FAILURE);
+    }
+    replaying = replay_path != NULL;
+    if (record_path && !start_recording(&recorder, record_path, tick_hz)) {
+        fprintf(stderr, "cannot write input log %s\n", record_path);
+        exit(EXIT_FAILURE);
+    }
+#ifdef HEADLESS
+    if (headless_frames)
+        return runHeadless(headless_frames, width, height);
+#else
+    if (headless_frames) {
+        fprintf(stderr, "--headless needs a build with -DHEADLESS, see make headless\n");
+        return EXIT_FAILURE;
+    }
+#endif
+
     GLFWwindow* window = initGLFW(width, height);
 
     initGL (window, width, height);
     printf("%d\n",block_count);
     double last_update_time = glfwGetTime(), current_time;
+    double last_frame_time = last_update_time;
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
 
+        // Game logic runs in fixed ticks, as many as the time since the last frame allows
+        current_time = glfwGetTime();
+        advance_world(current_time - last_frame_time);
+        last_frame_time = current_time;
+        if (world.game_over) {
+            printf("game over\n");
+            break;
+        }
+
         // OpenGL Draw commands
         draw();
         // Swap Frame Buffer in double buffering
@@ -1016,10 +2787,20 @@ int main (int argc, char** argv)
         current_time = glfwGetTime(); // Time in seconds
         if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
             // do something every 0.5 seconds ..
+            if (show_render_stats)
+                printf("draws: %d  state calls: %d issued, %d elided  objects: %d visible, %d culled\n",
+                        StateCache.lastDrawCalls, StateCache.lastIssued, StateCache.lastElided,
+                        Culling.lastVisible, Culling.lastCulled);
+            if (show_render_stats && Latency.moves)
+                printf("input: %d moves, %.2f ms average, %.2f ms worst latency, %d dropped\n",
+                        Latency.moves, 1000*Latency.total/Latency.moves, 1000*Latency.worst, Input.dropped.load(std::memory_order_relaxed));
+            Latency.moves = 0;
+            Latency.total = Latency.worst = 0;
             last_update_time = current_time;
         }
     }
 
+    stop_recording(&recorder);
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
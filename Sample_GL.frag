@@ -0,0 +1,20 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 fragColor;
+in vec3 fragEdge; // position across the face (xy) and outline width (z)
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // Output color = color specified in the vertex shader,
+    // interpolated between all 3 surrounding vertices of the triangle
+    color = fragColor;
+
+    // Faces with an outline width get a black frame of that size along their edges
+    vec2 d = min(fragEdge.xy, 1.0 - fragEdge.xy);
+    if (min(d.x, d.y) < fragEdge.z)
+        color = vec3(0.0);
+}
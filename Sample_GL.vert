@@ -0,0 +1,46 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// per-instance data for the instanced tile path : tile offset and shm flag
+// (attributes left disabled read as 0, so regular draws are unaffected)
+layout (location = 2) in vec3 instanceOffset;
+layout (location = 3) in float instanceShm;
+
+// position across the face and outline width, used by Sample_GL.frag to draw tile outlines
+layout (location = 4) in vec3 vertexEdge;
+
+// per-frame camera data, updated once per frame from one uniform buffer
+layout (std140) uniform Camera {
+    mat4 Projection;
+    mat4 View;
+    mat4 VP;
+    float Time;
+};
+
+uniform mat4 Model;
+
+// tile bobbing : y += ShmAmp * sin(Time * ShmOmega) for tiles with shm set
+uniform float ShmAmp;
+uniform float ShmOmega;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec3 fragEdge;
+
+void main ()
+{
+    vec4 v = Model * vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    v.xyz += instanceOffset;
+    v.y += instanceShm * ShmAmp * sin(Time * ShmOmega); // bobbing tiles
+
+    // The color of each vertex will be interpolated
+    // to produce the color of each fragment
+    fragColor = vertexColor;
+    fragEdge = vertexEdge;
+
+    // Output position of the vertex, in clip space : VP * Model * position
+    gl_Position = VP * v;
+}
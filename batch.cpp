@@ -0,0 +1,188 @@
+/* Runs many independent worlds from game_logic.h across all cores and summarises how they end.
+   Each run plays random arrow presses from its own seed (seed + run number), drawn per 60 Hz
+   frame, or follows a script file of "<seconds> <U|L|R|D>" lines, so results do not depend
+   on thread scheduling and stay the same in seconds at any --tick-hz.
+   Usage: batch [--runs N] [--threads T] [--ticks N] [--seed S] [--tick-hz HZ]
+                [--move-every K] [--script FILE] */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "game_logic.h"
+
+using namespace std;
+
+struct BatchOptions {
+    int runs;
+    int threads;
+    long ticks;// per run
+    unsigned seed;
+    double tick_hz;
+    int move_every;
+    vector< pair<double,int> > script;// (seconds, move) sorted by time, empty for random input
+};
+
+struct RunResult {
+    long ticks;
+    bool game_over;
+    float player_pos[3];
+};
+
+RunResult play(const BatchOptions& options, int run)
+{
+    World world;
+    init_world(&world, options.tick_hz);
+    mt19937 random(options.seed + run);
+    size_t next = 0;
+    long frame = 0;
+    while (world.tick < options.ticks && !world.game_over) {
+        if (!options.script.empty()) {
+            for (; next < options.script.size() && options.script[next].first <= world_time(world); next++)
+                world.move = options.script[next].second;
+        }
+        else
+            for (; frame*options.tick_hz <= world.tick*60.0; frame++)
+                if (random() % options.move_every == 0)
+                    world.move = 1 + random() % 4;
+        update_world(&world);
+    }
+    RunResult result;
+    result.ticks = world.tick;
+    result.game_over = world.game_over;
+    memcpy(result.player_pos, world.player_pos, sizeof(result.player_pos));
+    return result;
+}
+
+/* Work-stealing pool - every worker starts with an equal share of the runs in its own deque,
+   takes work from the back of it and steals from the front of the others once it is empty.
+   Runs end after very different numbers of ticks, so a fixed split alone would leave cores idle */
+struct WorkQueue {
+    mutex lock;
+    deque<int> runs;
+};
+
+bool next_run(vector<WorkQueue>& queues, int self, int& run)
+{
+    for (size_t k = 0; k < queues.size(); k++) {
+        WorkQueue& queue = queues[(self + k) % queues.size()];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.runs.empty())
+            continue;
+        if (k == 0) {
+            run = queue.runs.back();
+            queue.runs.pop_back();
+        }
+        else {
+            run = queue.runs.front();
+            queue.runs.pop_front();
+        }
+        return true;
+    }
+    return false;// nothing is ever added, so empty everywhere means done
+}
+
+void worker(const BatchOptions& options, vector<WorkQueue>& queues, int self, vector<RunResult>& results)
+{
+    int run;
+    while (next_run(queues, self, run))
+        results[run] = play(options, run);
+}
+
+bool load_script(const char* path, vector< pair<double,int> >& script)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    double time;
+    char key;
+    while (fscanf(file, "%lf %c", &time, &key) == 2) {
+        const char* keys = "ULRD";// same numbering as World.move
+        const char* found = strchr(keys, key);
+        if (found && key)
+            script.push_back(make_pair(time, (int)(found - keys) + 1));
+    }
+    fclose(file);
+    stable_sort(script.begin(), script.end());
+    return true;
+}
+
+int main (int argc, char** argv)
+{
+    BatchOptions options;
+    options.runs = 1000;
+    options.threads = max(1u, thread::hardware_concurrency());
+    options.ticks = 36000;// ten minutes of game time at 60 Hz
+    options.seed = 1;
+    options.tick_hz = 60;
+    options.move_every = 30;
+    for (int i = 1; i+1 < argc; i += 2) {
+        if (strcmp(argv[i], "--runs") == 0)
+            options.runs = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--threads") == 0)
+            options.threads = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--ticks") == 0)
+            options.ticks = atol(argv[i+1]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            options.seed = strtoul(argv[i+1], NULL, 10);
+        else if (strcmp(argv[i], "--tick-hz") == 0)
+            options.tick_hz = atof(argv[i+1]);
+        else if (strcmp(argv[i], "--move-every") == 0)
+            options.move_every = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--script") == 0) {
+            if (!load_script(argv[i+1], options.script)) {
+                fprintf(stderr, "cannot read %s\n", argv[i+1]);
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.runs <= 0 || options.threads <= 0 || options.tick_hz <= 0 || options.move_every <= 0) {
+        fprintf(stderr, "--runs, --threads, --tick-hz and --move-every must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    vector<WorkQueue> queues(options.threads);
+    for (int run = 0; run < options.runs; run++)
+        queues[run % options.threads].runs.push_back(run);
+    vector<RunResult> results(options.runs);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int i = 0; i < options.threads; i++)
+        threads.push_back(thread(worker, ref(options), ref(queues), i, ref(results)));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // outcomes
+    vector<long> survived;
+    long total_ticks = 0;
+    int game_overs = 0;
+    for (int run = 0; run < options.runs; run++) {
+        total_ticks += results[run].ticks;
+        if (results[run].game_over) {
+            game_overs++;
+            survived.push_back(results[run].ticks);
+        }
+    }
+    sort(survived.begin(), survived.end());
+
+    printf("%d runs, %d game over, %d alive after %ld ticks\n", options.runs, game_overs, options.runs - game_overs, options.ticks);
+    if (!survived.empty())
+        printf("game over after: min %.1f s  median %.1f s  p90 %.1f s  max %.1f s\n",
+                survived.front()/options.tick_hz, survived[survived.size()/2]/options.tick_hz,
+                survived[survived.size()*9/10]/options.tick_hz, survived.back()/options.tick_hz);
+    printf("%d threads, %.3f s, %.0f ticks/s\n", options.threads, seconds, seconds > 0 ? total_ticks/seconds : 0);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+/* Plays the same scripted game at 30, 60 and 120 Hz and fails unless it ends at the same
+   time in seconds, give or take one tick of the slowest rate. Run by make check */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "game_logic.h"
+
+struct Press {
+    double time;// seconds
+    int move;
+};
+
+/* Right onto the boat while it is at z=2, then stay on board until it moves on at t=2 */
+static const Press script[] = {
+    { 0.2, 3 }, { 0.4, 3 }, { 0.6, 3 }, { 0.8, 3 }, { 1.0, 3 },
+};
+
+double game_over_time(double tick_hz)
+{
+    World world;
+    init_world(&world, tick_hz);
+    size_t next = 0;
+    while (!world.game_over && world_time(world) < 60) {
+        for (; next < sizeof(script)/sizeof(script[0]) && script[next].time <= world_time(world); next++)
+            world.move = script[next].move;
+        update_world(&world);
+    }
+    return world.game_over ? world_time(world) : -1;
+}
+
+int main ()
+{
+    const double rates[] = { 30, 60, 120 };
+    double expected = game_over_time(60);
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        double seconds = game_over_time(rates[i]);
+        bool ok = seconds >= 0 && fabs(seconds - expected) <= 1/rates[0] + 1e-9;
+        printf("%g Hz: game over at %.3f s%s\n", rates[i], seconds, ok ? "" : " - FAILED");
+        failed += !ok;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Writes a C++ header embedding each GLSL file as a constexpr string named after it
+# (Sample_GL.vert -> Sample_GL_vert), plus the embedded_shaders table looked up by file name.
+# Run by the Makefile whenever a shader changes.
+echo "// Generated by embed_shaders.sh from $*, do not edit"
+echo "#pragma once"
+echo
+for f in "$@"; do
+    name=$(basename "$f" | tr -c 'A-Za-z0-9\n' '_')
+    printf 'constexpr char %s[] = R"GLSL(' "$name"
+    cat "$f"
+    echo ')GLSL";'
+    echo
+done
+echo "struct EmbeddedShader {"
+echo "    const char * name;"
+echo "    const char * source;"
+echo "};"
+echo "constexpr EmbeddedShader embedded_shaders[] = {"
+for f in "$@"; do
+    echo "    { \"$(basename "$f")\", $(basename "$f" | tr -c 'A-Za-z0-9\n' '_') },"
+done
+echo "};"
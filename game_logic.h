@@ -0,0 +1,78 @@
+// Game rules without any GL or GLFW dependency, shared by the game and the simulate tool
+#pragma once
+
+/* Game state - advanced by update_world() at a fixed tick_hz ticks per second,
+   independently of any rendering. Speeds are per second so any tick_hz plays the same game */
+#define SINK_SPEED 30// units per second, the old 0.5 per frame at 60 fps
+
+struct World {
+    double tick_hz;
+    long tick;
+    int move;// arrow key waiting for the next tick: 1 up, 2 left, 3 right, 4 down, 0 none
+    float player_pos[3];
+    float boatx, boatz;
+    bool game_over;
+};
+
+inline double world_time(const World &w)
+{
+    return w.tick/w.tick_hz;
+}
+
+inline void init_world(World * w, double tick_hz)
+{
+    w->tick_hz=tick_hz;
+    w->tick=0;
+    w->move=0;
+    w->player_pos[0]=2;
+    w->player_pos[1]=2;
+    w->player_pos[2]=2;
+    w->boatx=12;
+    w->boatz=0;
+    w->game_over=false;
+}
+
+inline void update_boat(World * w)
+{
+    int a = world_time(*w);
+    if(a%10==0)
+    {
+        w->boatx=12;
+        w->boatz=0;
+    }
+    else
+    {
+        w->boatz=a%10 * 2;
+    }
+}
+
+inline void update_player(World * w)
+{
+    float * player_pos=w->player_pos;
+    if(player_pos[0]<0||player_pos[0]>=30||player_pos[2]>=20||player_pos[2]<0||(player_pos[0]>=12&&player_pos[0]<14&&player_pos[2]!=w->boatz))//drowning conditions
+    {
+        player_pos[1]-=SINK_SPEED/w->tick_hz;
+    }
+    else
+    {
+        if(w->move==3)
+            player_pos[0]+=2;
+        if(w->move==2)
+            player_pos[0]-=2;
+        if(w->move==4)
+            player_pos[2]+=2;
+        if(w->move==1)
+            player_pos[2]-=2;
+        w->move=0;
+    }
+    if(player_pos[1]<-1)
+        w->game_over=true;
+}
+
+/* One fixed step of the game, the boat moves first since drowning depends on where it is */
+inline void update_world(World * w)
+{
+    update_boat(w);
+    update_player(w);
+    w->tick++;
+}
@@ -0,0 +1,117 @@
+// Recording and replay of the moves fed to a World, no GL or GLFW dependency.
+// A log is a header followed by one record per move, all integers as LEB128 varints:
+//   "GINP", version, tick_hz (double), then per move: tick delta, move, microseconds since the previous move
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define INPUT_LOG_VERSION 1
+
+struct InputEvent {
+    long tick;// tick the move was given to the world
+    int move;// World.move value
+    double time;// seconds since recording started, for lining up with timing logs
+};
+
+struct InputRecorder {
+    FILE * file;// NULL when not recording
+    long last_tick;
+    double last_time;
+};
+
+inline void write_varint(FILE * file, unsigned long value)
+{
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        fputc(value ? byte | 0x80 : byte, file);
+    } while (value);
+}
+
+inline bool read_varint(FILE * file, unsigned long * value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF)
+            return false;
+        *value |= (unsigned long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline bool start_recording(InputRecorder * recorder, const char * path, double tick_hz)
+{
+    recorder->file = fopen(path, "wb");
+    recorder->last_tick = 0;
+    recorder->last_time = 0;
+    if (recorder->file == NULL)
+        return false;
+    fwrite("GINP", 1, 4, recorder->file);
+    write_varint(recorder->file, INPUT_LOG_VERSION);
+    fwrite(&tick_hz, sizeof(tick_hz), 1, recorder->file);
+    return true;
+}
+
+/* Ticks only go forward, so each record stores the distance from the previous one */
+inline void record_input(InputRecorder * recorder, long tick, int move, double time)
+{
+    if (recorder->file == NULL)
+        return;
+    write_varint(recorder->file, tick - recorder->last_tick);
+    write_varint(recorder->file, move);
+    write_varint(recorder->file, time > recorder->last_time ? (unsigned long)((time - recorder->last_time)*1e6 + 0.5) : 0);
+    // flushed per move so the log survives a crash, which is when it is needed most
+    fflush(recorder->file);
+    recorder->last_tick = tick;
+    recorder->last_time = time > recorder->last_time ? time : recorder->last_time;
+}
+
+inline void stop_recording(InputRecorder * recorder)
+{
+    if (recorder->file)
+        fclose(recorder->file);
+    recorder->file = NULL;
+}
+
+/* Reads a whole log, tick_hz is the rate it was recorded at and has to be used for the replay */
+inline bool load_input_log(const char * path, double * tick_hz, std::vector<InputEvent> * events)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    char magic[4];
+    unsigned long version;
+    bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "GINP", 4) == 0
+        && read_varint(file, &version) && version == INPUT_LOG_VERSION
+        && fread(tick_hz, sizeof(*tick_hz), 1, file) == 1;
+
+    InputEvent event = { 0, 0, 0 };
+    unsigned long tick_delta, move, micros;
+    while (ok && read_varint(file, &tick_delta) && read_varint(file, &move) && read_varint(file, &micros)) {
+        event.tick += tick_delta;
+        event.move = move;
+        event.time += micros/1e6;
+        events->push_back(event);
+    }
+    fclose(file);
+    return ok;
+}
+
+struct InputReplay {
+    std::vector<InputEvent> events;
+    size_t next;
+};
+
+/* Move recorded for tick, 0 if there is none - called once per tick with increasing ticks */
+inline int replay_input(InputReplay * replay, long tick)
+{
+    int move = 0;
+    for (; replay->next < replay->events.size() && replay->events[replay->next].tick <= tick; replay->next++)
+        move = replay->events[replay->next].move;
+    return move;
+}
@@ -0,0 +1,89 @@
+/* Runs the game rules from game_logic.h without a window or GL context, as fast as possible.
+   Input is a random arrow key every few 60 Hz frames, so runs are repeatable for a given seed
+   and play the same presses at any --tick-hz,
+   or the moves of a log written by the game's --record, replayed at full speed.
+   Usage: simulate [--ticks N] [--seed S] [--tick-hz HZ] [--move-every K] [--record FILE] [--replay FILE] */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+
+#include "game_logic.h"
+#include "input_log.h"
+
+using namespace std;
+
+int main (int argc, char** argv)
+{
+    long ticks = 1000000;
+    unsigned seed = 1;
+    double tick_hz = 60;
+    int move_every = 30;// on average one key press per half second
+    const char * record_path = NULL;
+    const char * replay_path = NULL;
+    for (int i = 1; i+1 < argc; i += 2) {
+        if (strcmp(argv[i], "--ticks") == 0)
+            ticks = atol(argv[i+1]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            seed = strtoul(argv[i+1], NULL, 10);
+        else if (strcmp(argv[i], "--tick-hz") == 0)
+            tick_hz = atof(argv[i+1]);
+        else if (strcmp(argv[i], "--move-every") == 0)
+            move_every = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--record") == 0)
+            record_path = argv[i+1];
+        else if (strcmp(argv[i], "--replay") == 0)
+            replay_path = argv[i+1];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (tick_hz <= 0 || move_every <= 0) {
+        fprintf(stderr, "--tick-hz and --move-every must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    InputReplay replay = { vector<InputEvent>(), 0 };
+    // a replay has to run at the rate it was recorded with to reach the same state
+    if (replay_path && !load_input_log(replay_path, &tick_hz, &replay.events)) {
+        fprintf(stderr, "cannot read input log %s\n", replay_path);
+        return EXIT_FAILURE;
+    }
+    InputRecorder recorder = { NULL, 0, 0 };
+    if (record_path && !start_recording(&recorder, record_path, tick_hz)) {
+        fprintf(stderr, "cannot write input log %s\n", record_path);
+        return EXIT_FAILURE;
+    }
+
+    World world;
+    init_world(&world, tick_hz);
+    mt19937 random(seed);
+
+    long frame = 0;// random presses are drawn per 60 Hz frame, the rate the game used to tick at
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    while (world.tick < ticks && !world.game_over) {
+        int move = 0;
+        if (replay_path)
+            move = replay_input(&replay, world.tick);
+        else
+            // every frame up to this tick's time, frame/60 <= tick/tick_hz
+            for (; frame*tick_hz <= world.tick*60.0; frame++)
+                if (random() % move_every == 0)
+                    move = 1 + random() % 4;
+        if (move) {
+            world.move = move;
+            record_input(&recorder, world.tick, move, world_time(world));
+        }
+        update_world(&world);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stop_recording(&recorder);
+
+    printf("%s after %ld ticks (%.1f s of game time), player at %g %g %g\n",
+            world.game_over ? "game over" : "alive", world.tick, world_time(world),
+            world.player_pos[0], world.player_pos[1], world.player_pos[2]);
+    printf("%.3f s, %.0f ticks/s\n", seconds, seconds > 0 ? world.tick/seconds : 0);
+    return EXIT_SUCCESS;
+}